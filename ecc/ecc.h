@@ -1,26 +1,219 @@
+// CPU pinning in the job system needs the GNU extensions, which only works if
+// this is included before any system header
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Resolve a component type to its process wide component id. The name lookup
+// only happens the first time each call site runs, after that the id comes
+// straight out of a static cache
+#define COMPONENT_ID(ComponentType)                                            \
+  ({                                                                           \
+    static size_t cachedComponentId = 0; /* id + 1 so 0 means unresolved */    \
+    size_t componentId =                                                       \
+        __atomic_load_n(&cachedComponentId, __ATOMIC_RELAXED);                 \
+    if (!componentId) {                                                        \
+      componentId = EccComponentIdForName(#ComponentType) + 1;                 \
+      __atomic_store_n(&cachedComponentId, componentId, __ATOMIC_RELAXED);     \
+    }                                                                          \
+    componentId - 1;                                                           \
+  })
+
+// Helpers for macros taking a list of component types (up to 8)
+#define ECC_NARGS(...) ECC_NARGS_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1)
+#define ECC_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+#define ECC_CONCAT(a, b) ECC_CONCAT_(a, b)
+#define ECC_CONCAT_(a, b) a##b
+
+// Apply macro to each argument, separating the results with commas
+#define ECC_MAP(macro, ...)                                                    \
+  ECC_CONCAT(ECC_MAP_, ECC_NARGS(__VA_ARGS__))(macro, __VA_ARGS__)
+#define ECC_MAP_1(m, a) m(a)
+#define ECC_MAP_2(m, a, ...) m(a), ECC_MAP_1(m, __VA_ARGS__)
+#define ECC_MAP_3(m, a, ...) m(a), ECC_MAP_2(m, __VA_ARGS__)
+#define ECC_MAP_4(m, a, ...) m(a), ECC_MAP_3(m, __VA_ARGS__)
+#define ECC_MAP_5(m, a, ...) m(a), ECC_MAP_4(m, __VA_ARGS__)
+#define ECC_MAP_6(m, a, ...) m(a), ECC_MAP_5(m, __VA_ARGS__)
+#define ECC_MAP_7(m, a, ...) m(a), ECC_MAP_6(m, __VA_ARGS__)
+#define ECC_MAP_8(m, a, ...) m(a), ECC_MAP_7(m, __VA_ARGS__)
 
 // AddComponentToEntity(Bucket *bucket, Entity *entity, size_t componentSize,
 // char *componentName)
 // assert(entity != NULL);
 #define ADD_COMPONENT_TO_ENTITY(bucket, entity, ComponentType)                 \
   ({                                                                           \
-    ComponentType *comp = AddComponentToEntity(                                \
-        bucket, entity, sizeof(ComponentType), #ComponentType);                \
+    ComponentType *comp = AddComponentToEntityByComponentId(                   \
+        bucket, entity, sizeof(ComponentType), COMPONENT_ID(ComponentType));   \
     comp; /* Return the pointer to the component */                            \
   })
 
 #define GET_COMPONENT_FROM_ENTITY(bucket, entity, ComponentType)               \
   ({                                                                           \
-    ComponentType *comp =                                                      \
-        GetComponentForEntity(bucket, entity, #ComponentType);                 \
+    ComponentType *comp = GetComponentForEntityByComponentId(                  \
+        bucket, entity, COMPONENT_ID(ComponentType));                          \
+    comp;                                                                      \
+  })
+
+// Same as GET_COMPONENT_FROM_ENTITY but stamps the component as changed so
+// systems filtering on changes will see it
+#define GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, entity, ComponentType)       \
+  ({                                                                           \
+    ComponentType *comp = GetMutableComponentForEntityByComponentId(           \
+        bucket, entity, COMPONENT_ID(ComponentType));                          \
     comp;                                                                      \
   })
 
+// Fetch several components of one entity in a single pass. `out` is an array
+// of void pointers filled in the order the types are listed, evaluates to 1 if
+// the entity has all of them and 0 (with out left NULL) otherwise
+//
+//   void *components[2];
+//   if (GET_COMPONENTS_FROM_ENTITY(bucket, entity, components, Position,
+//                                  Speed)) {
+//     Position *position = components[0];
+//     ...
+#define GET_COMPONENTS_FROM_ENTITY(bucket, entity, out, ...)                   \
+  ({                                                                           \
+    size_t componentIds[] = {ECC_MAP(COMPONENT_ID, __VA_ARGS__)};              \
+    GetComponentsForEntityByComponentIds(                                      \
+        bucket, entity, componentIds,                                          \
+        sizeof(componentIds) / sizeof(componentIds[0]), (void **)(out));       \
+  })
+
+// Same as GET_COMPONENTS_FROM_ENTITY but the first `writeCount` types listed
+// are stamped as changed, so list the ones the caller writes first
+//
+//   void *components[3];
+//   if (GET_MUTABLE_COMPONENTS_FROM_ENTITY(bucket, entity, components, 1,
+//                                          Position, Velocity, Mass)) {
+//     Position *position = components[0]; // stamped as changed
+//     ...
+#define GET_MUTABLE_COMPONENTS_FROM_ENTITY(bucket, entity, out, writeCount,    \
+                                           ...)                                \
+  ({                                                                           \
+    size_t componentIds[] = {ECC_MAP(COMPONENT_ID, __VA_ARGS__)};              \
+    GetMutableComponentsForEntityByComponentIds(                               \
+        bucket, entity, componentIds,                                          \
+        sizeof(componentIds) / sizeof(componentIds[0]), (writeCount),          \
+        (void **)(out));                                                       \
+  })
+
+// Build a mask out of a list of component types, registering any the bucket
+// hasn't seen yet
+#define COMPONENT_MASK(bucket, ...)                                            \
+  ({                                                                           \
+    size_t componentIds[] = {ECC_MAP(COMPONENT_ID, __VA_ARGS__)};              \
+    size_t componentSizes[] = {ECC_MAP(sizeof, __VA_ARGS__)};                  \
+    BucketComponentMaskForComponentIds(                                        \
+        bucket, componentIds, componentSizes,                                  \
+        sizeof(componentIds) / sizeof(componentIds[0]));                       \
+  })
+
+// Register a cached query over every entity with all of the listed components
+#define REGISTER_QUERY(bucket, ...)                                            \
+  BucketRegisterQuery(bucket, COMPONENT_MASK(bucket, __VA_ARGS__))
+
+// Register a cached query from QueryTerms fields, e.g.
+//
+//   REGISTER_QUERY_WITH_TERMS(
+//       bucket, .include = COMPONENT_MASK(bucket, GridPosition, SnakeNode),
+//       .exclude = COMPONENT_MASK(bucket, SnakeHead));
+#define REGISTER_QUERY_WITH_TERMS(bucket, ...)                                 \
+  BucketRegisterQueryWithTerms(bucket, (QueryTerms){__VA_ARGS__})
+
+// Register a system from SystemDesc fields, e.g.
+//
+//   REGISTER_SYSTEM(bucket, .name = "Render", .phase = SYSTEM_PHASE_RENDER,
+//                   .terms = {.include = COMPONENT_MASK(bucket, Renderer)},
+//                   .each = RenderSystem, .userData = gameState);
+#define REGISTER_SYSTEM(bucket, ...)                                           \
+  BucketRegisterSystem(bucket, (SystemDesc){__VA_ARGS__})
+
+// Start iterating a query in spans of the listed components, see
+// QuerySpanNext
+#define QUERY_ITERATE_SPANS(bucket, query, ...)                                \
+  ({                                                                           \
+    size_t componentIds[] = {ECC_MAP(COMPONENT_ID, __VA_ARGS__)};              \
+    QueryIterateSpansByComponentIds(                                           \
+        bucket, query, componentIds,                                           \
+        sizeof(componentIds) / sizeof(componentIds[0]));                       \
+  })
+
+// The component of type index `i` for the k'th entity in a span
+#define SPAN_COMPONENT(span, i, ComponentType, k)                              \
+  ((ComponentType *)((char *)(span).components[i] + (k) * (span).strides[i]))
+
+// Create a spatial grid over every entity with ComponentType, reading the
+// position from two float members of it, e.g.
+//   SPATIAL_GRID_CREATE(bucket, GridPosition, currentPos.x, currentPos.y, 32)
+#define SPATIAL_GRID_CREATE(bucket, ComponentType, xMember, yMember, cellSize) \
+  SpatialGridCreate(bucket,                                                    \
+                    BucketComponentTypeForComponentIdOrRegister(               \
+                        bucket, COMPONENT_ID(ComponentType),                   \
+                        sizeof(ComponentType), 0),                             \
+                    offsetof(ComponentType, xMember),                          \
+                    offsetof(ComponentType, yMember), cellSize)
+
 #define REMOVE_COMPONENT_FROM_ENTITY(bucket, entity, ComponentType)            \
-  ({ RemoveComponentFromEntity(bucket, entity, #ComponentType); })
+  ({                                                                           \
+    RemoveComponentFromEntityByComponentId(bucket, entity,                     \
+                                           COMPONENT_ID(ComponentType));       \
+  })
+
+#define ENABLE_COMPONENT_FOR_ENTITY(bucket, entity, ComponentType)             \
+  ({                                                                           \
+    SetComponentEnabledForEntityByComponentId(                                 \
+        bucket, entity, COMPONENT_ID(ComponentType), 1);                       \
+  })
+
+#define DISABLE_COMPONENT_FOR_ENTITY(bucket, entity, ComponentType)            \
+  ({                                                                           \
+    SetComponentEnabledForEntityByComponentId(                                 \
+        bucket, entity, COMPONENT_ID(ComponentType), 0);                       \
+  })
+
+// Point an entity at a shared value equal to `value`, the returned pointer is
+// shared with every other entity holding the same value so treat it as const
+#define SET_SHARED_COMPONENT_FOR_ENTITY(bucket, entity, ComponentType, value)  \
+  ({                                                                           \
+    ComponentType sharedValue = (value);                                       \
+    const ComponentType *comp = SetSharedComponentForEntityByComponentId(      \
+        bucket, entity, sizeof(ComponentType), COMPONENT_ID(ComponentType),    \
+        &sharedValue);                                                         \
+    comp;                                                                      \
+  })
+
+// Read a shared component. GET_COMPONENT_FROM_ENTITY returns NULL for shared
+// types since the value may be in use by other entities
+#define GET_SHARED_COMPONENT_FROM_ENTITY(bucket, entity, ComponentType)        \
+  ({                                                                           \
+    const ComponentType *comp = GetSharedComponentForEntityByComponentId(      \
+        bucket, entity, COMPONENT_ID(ComponentType));                          \
+    comp;                                                                      \
+  })
+
+// Get a pointer to a shared component that only this entity references, the
+// value is copied first if any other entity is using it
+#define GET_MUTABLE_SHARED_COMPONENT_FROM_ENTITY(bucket, entity, ComponentType) \
+  ({                                                                           \
+    ComponentType *comp = GetMutableSharedComponentForEntityByComponentId(     \
+        bucket, entity, COMPONENT_ID(ComponentType));                          \
+    comp;                                                                      \
+  })
 
 
 // Memory Arena utilities
@@ -62,17 +255,24 @@ void ArenaDestroy(Arena *arena) {
   free(arena);
 }
 
+#ifndef ARENA_ALIGNMENT
+#define ARENA_ALIGNMENT 16
+#endif
+
 // Basically just store pointer to top, bump top up by size and assign data into
-// pointer <-> top
+// pointer <-> top. Allocations start on an ARENA_ALIGNMENT boundary like malloc,
+// atomics on a word that straddles a cache line take a bus lock
 void *ArenaAllocate(Arena *arena, size_t size) {
+  size_t start = (arena->top + ARENA_ALIGNMENT - 1) &
+                 ~(size_t)(ARENA_ALIGNMENT - 1);
 
-  if (arena->top + size > arena->capacity) {
+  if (start + size > arena->capacity) {
     return NULL;
   }
 
-  void *ptr = arena->data + arena->top;
+  void *ptr = arena->data + start;
   memset(ptr, 0, size);
-  arena->top += size;
+  arena->top = start + size;
 
   return ptr;
 }
@@ -114,13 +314,10 @@ LinkedListNode *LinkedListPush(LinkedList *list, void *value) {
     return NULL;
   }
 
+  // push onto the front so the list can be walked from head and popped like
+  // a stack
   node->value = value;
-  node->next = NULL;
-
-  LinkedListNode *head = list->head;
-  if (head) {
-    head->next = node;
-  }
+  node->next = list->head;
 
   list->head = node;
 
@@ -149,6 +346,162 @@ void *LinkedListPop(LinkedList *list) {
 
 // ---------------------------------------------------------------------------------------------------
 
+// Hierarchical bitset utilities
+// ---------------------------------------------------------------------------------------------------
+
+// A bitset with two summary levels on top. Each bit of level1 says whether a
+// level0 word (64 entities) has anything in it and each bit of level2 says the
+// same for a level1 word (4096 entities), so walking the set can skip empty
+// stretches of 4096 or 262144 entities at a time.
+//
+// Summary bits are allowed to be set over empty words (it only costs a wasted
+// look) but never the other way around. Setting is done atomically so it is
+// safe from parallel code, clearing the summaries isn't so HiBitSetClearAtomic
+// leaves them alone and HiBitSetClear must only be used single threaded
+
+typedef struct {
+  uint64_t *level0;
+  uint64_t *level1;
+  uint64_t *level2;
+  size_t level0Words;
+  size_t level1Words;
+  size_t level2Words;
+} HiBitSet;
+
+int HiBitSetInit(HiBitSet *set, Arena *arena, size_t bits) {
+  set->level0Words = (bits + 63) / 64;
+  set->level1Words = (set->level0Words + 63) / 64;
+  set->level2Words = (set->level1Words + 63) / 64;
+  set->level0 = ArenaAllocate(arena, sizeof(uint64_t) * set->level0Words);
+  set->level1 = ArenaAllocate(arena, sizeof(uint64_t) * set->level1Words);
+  set->level2 = ArenaAllocate(arena, sizeof(uint64_t) * set->level2Words);
+  return set->level0 && set->level1 && set->level2;
+}
+
+void HiBitSetSet(HiBitSet *set, size_t bit) {
+  size_t word = bit / 64;
+  __atomic_fetch_or(&set->level0[word], (uint64_t)1 << (bit % 64),
+                    __ATOMIC_RELAXED);
+  __atomic_fetch_or(&set->level1[word / 64], (uint64_t)1 << (word % 64),
+                    __ATOMIC_RELAXED);
+  __atomic_fetch_or(&set->level2[word / 4096],
+                    (uint64_t)1 << ((word / 64) % 64), __ATOMIC_RELAXED);
+}
+
+void HiBitSetClearAtomic(HiBitSet *set, size_t bit) {
+  __atomic_fetch_and(&set->level0[bit / 64], ~((uint64_t)1 << (bit % 64)),
+                     __ATOMIC_RELAXED);
+}
+
+void HiBitSetClear(HiBitSet *set, size_t bit) {
+  size_t word = bit / 64;
+  set->level0[word] &= ~((uint64_t)1 << (bit % 64));
+  if (set->level0[word]) {
+    return;
+  }
+  set->level1[word / 64] &= ~((uint64_t)1 << (word % 64));
+  if (set->level1[word / 64]) {
+    return;
+  }
+  set->level2[word / 4096] &= ~((uint64_t)1 << ((word / 64) % 64));
+}
+
+int HiBitSetTest(HiBitSet *set, size_t bit) {
+  return (set->level0[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Index of the first set bit at or after `from`, or SIZE_MAX if there isn't
+// one. Empty words are skipped through the summaries so the cost follows the
+// number of set bits rather than the distance between them
+size_t HiBitSetNext(HiBitSet *set, size_t from) {
+  size_t w = from / 64;
+  if (w >= set->level0Words) {
+    return SIZE_MAX;
+  }
+
+  uint64_t bits = set->level0[w] & (~(uint64_t)0 << (from % 64));
+  while (!bits) {
+    w++;
+    size_t j = w / 64;
+    if (j >= set->level1Words) {
+      return SIZE_MAX;
+    }
+
+    uint64_t bits1 = set->level1[j] & (~(uint64_t)0 << (w % 64));
+    while (!bits1) {
+      j++;
+      size_t a = j / 64;
+      if (a >= set->level2Words) {
+        return SIZE_MAX;
+      }
+      uint64_t bits2 = set->level2[a] & (~(uint64_t)0 << (j % 64));
+      if (!bits2) {
+        // nothing left in this level2 word, the next pass starts the one after
+        j = a * 64 + 63;
+        continue;
+      }
+      j = a * 64 + __builtin_ctzll(bits2);
+      bits1 = set->level1[j];
+    }
+
+    w = j * 64 + __builtin_ctzll(bits1);
+    bits = set->level0[w];
+  }
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+// Component id utilities
+// ---------------------------------------------------------------------------------------------------
+
+// Every component name gets a process wide id the first time it is seen so the
+// macros can cache it per call site and buckets can map it straight to their
+// own ComponentType without comparing strings
+
+#ifndef MAX_COMPONENT_NAMES
+#define MAX_COMPONENT_NAMES 256
+#endif
+
+// Returned when the name table is full
+#define INVALID_COMPONENT_ID ((size_t)-1)
+
+char *eccComponentNames[MAX_COMPONENT_NAMES];
+size_t eccComponentNameCount = 0;
+char eccComponentNamesLock = 0;
+
+// Look up (or assign) the id for a component name. It is an O(n) operation
+// over every name seen so far, the macros only call it once per call site
+size_t EccComponentIdForName(const char *name) {
+  while (__atomic_test_and_set(&eccComponentNamesLock, __ATOMIC_ACQUIRE)) {
+  }
+
+  size_t id = INVALID_COMPONENT_ID;
+  for (size_t i = 0; i < eccComponentNameCount; i++) {
+    if (strcmp(eccComponentNames[i], name) == 0) {
+      id = i;
+      break;
+    }
+  }
+
+  if (id == INVALID_COMPONENT_ID &&
+      eccComponentNameCount < MAX_COMPONENT_NAMES) {
+    // names registered at runtime might not outlive us so keep our own copy
+    size_t length = strlen(name) + 1;
+    char *copy = malloc(length);
+    if (copy) {
+      memcpy(copy, name, length);
+      id = eccComponentNameCount++;
+      eccComponentNames[id] = copy;
+    }
+  }
+
+  __atomic_clear(&eccComponentNamesLock, __ATOMIC_RELEASE);
+  return id;
+}
+
+// ---------------------------------------------------------------------------------------------------
+
 // Entities are just indexes into arrays and a bitmask signifying which
 // components they hold
 //
@@ -164,41 +517,184 @@ void *LinkedListPop(LinkedList *list) {
 
 // So I can change it later to support > 63 component types (0 is no components)
 typedef size_t BitMask;
-const size_t MAX_COMPONENT_TYPES = 63;
-const size_t MAX_QUERIES = 1000;
 
-const size_t MAX_ENTITIES = 10000;
+// These size the fixed arrays below so they have to be real constant
+// expressions, they can be overridden with -D at compile time
+#ifndef MAX_COMPONENT_TYPES
+#define MAX_COMPONENT_TYPES 63
+#endif
+
+#ifndef MAX_QUERIES
+#define MAX_QUERIES 1000
+#endif
+
+#ifndef MAX_ENTITIES
+#define MAX_ENTITIES 10000
+#endif
+
+// A single value of a shared component type. Many entities can point at the
+// same value, the data lives directly after the header so the pointers handed
+// out for a shared component can be walked back to their header
+typedef struct SharedComponentValue {
+  struct SharedComponentValue *next;
+  size_t id;       // Dense id of this value within its component type
+  size_t refCount; // Number of entities currently pointing at this value
+  char data[];
+} SharedComponentValue;
+
+// Walk back from the data pointer handed out for a shared component to the
+// value that owns it
+SharedComponentValue *SharedComponentValueFromData(void *data) {
+  return (SharedComponentValue *)((char *)data -
+                                  offsetof(SharedComponentValue, data));
+}
+
+// Drop one reference to a shared value. Values are never given back to the
+// arena, once unused they are recycled by the next new value of the same type
+void ReleaseSharedComponentValue(void *data) {
+  if (!data) {
+    return;
+  }
+
+  SharedComponentValue *value = SharedComponentValueFromData(data);
+  if (value->refCount > 0) {
+    value->refCount--;
+  }
+}
 
 typedef struct {
   BitMask mask; // The bitmask of this component type
-  char *name; // The name of the component (generally provided via the macro) -
-              // it needs to be allocated on the heap and cannot be changed
+  char *name; // The name of the component, interned in the bucket's arena so
+              // it can be compared by pointer
 
   size_t componentId; // The id of this component type in the bucket to which it
                       // is assigned - this is probably unnecessary
 
   size_t componentSize; // The size of an individual component of this type
 
+  size_t globalId; // The process wide id for this component's name
+
   void *entries[MAX_ENTITIES]; // pointer to array of pointers to actual structs
                                // containing the information for this component
                                // on a given entity
 
+  int isShared; // Entities hold pointers to deduplicated values rather than
+                // their own copy of the component
+  SharedComponentValue *sharedValues; // All values ever created for a shared
+                                      // component type (including unused ones)
+  size_t sharedValueCount;
+
+  uint32_t *addedTicks;   // Bucket tick at which each entity's component was
+                          // added
+  uint32_t *changedTicks; // Bucket tick at which each entity's component was
+                          // last added or fetched for writing
+  size_t version;     // Moves whenever a component of this type is written
+                      // after the version was last read, see
+  int versionWatched; // ComponentTypeVersion
+
+  char *compactRegions[2]; // Contiguous regions compaction alternates between,
+                           // only one of them holds live components at a time
+  size_t compactRegionCapacity[2]; // In components
+  int compactRegion;               // Region holding the last compacted payloads
+
+  HiBitSet presence; // Entities that have this component enabled
+
 } ComponentType;
 
+// Stamp a component as written at `tick`. The version only has to move if
+// someone read it since the last write, so a run of writes (from parallel
+// systems too) costs one atomic increment rather than one each
+void ComponentTypeMarkChanged(ComponentType *componentType, size_t entityId,
+                              uint32_t tick) {
+  componentType->changedTicks[entityId] = tick;
+  if (__atomic_load_n(&componentType->versionWatched, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&componentType->versionWatched, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&componentType->version, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// A number that is different after any later add or mutable fetch of a
+// component of this type, however many happen within one tick
+size_t ComponentTypeVersion(ComponentType *componentType) {
+  __atomic_store_n(&componentType->versionWatched, 1, __ATOMIC_RELAXED);
+  return __atomic_load_n(&componentType->version, __ATOMIC_RELAXED);
+}
+
+// Must be a power of two comfortably larger than MAX_COMPONENT_TYPES so probe
+// sequences stay short
+#ifndef COMPONENT_NAME_TABLE_SIZE
+#define COMPONENT_NAME_TABLE_SIZE 256
+#endif
+
+typedef struct {
+  uint64_t hash;
+  char *name; // Interned, NULL if the slot is empty
+  ComponentType *componentType;
+} ComponentNameSlot;
+
 typedef struct {
   size_t index;
   BitMask mask;
+  BitMask disabled; // Components the entity has but that queries should skip,
+                    // kept apart from mask so toggling never touches storage
 } Entity;
 
+// Called whenever compaction moves a component so anything holding on to the
+// old pointer can be patched up
+typedef void (*ComponentRelocatedFn)(ComponentType *componentType,
+                                     size_t entityId, void *from, void *to,
+                                     void *userData);
+
+typedef enum {
+  COMPACTION_SCAN, // Counting live components and how scattered they are
+  COMPACTION_MOVE, // Copying components into a contiguous region
+} CompactionPhase;
+
+// Where an incremental compaction pass got up to so it can resume next call
+typedef struct {
+  CompactionPhase phase;
+  size_t typeIndex;
+  size_t entityCursor;
+  size_t liveCount;
+  size_t scatteredCount; // Components not directly after the previous one
+  char *lastPayload;
+  int targetRegion;
+  size_t targetTop;
+  ComponentRelocatedFn onRelocate;
+  void *userData;
+} BucketCompaction;
+
+// The components of an entity that queries should consider
+BitMask EntityEnabledMask(Entity *entity) {
+  return entity->mask &
+         ~__atomic_load_n(&entity->disabled, __ATOMIC_RELAXED);
+}
+
 typedef struct {
   size_t componentIdTop;
   Arena *arena;
   ComponentType *components[MAX_COMPONENT_TYPES];
+  ComponentType *componentsByGlobalId[MAX_COMPONENT_NAMES]; // NULL if the
+                                                            // bucket hasn't
+                                                            // registered it
+  ComponentNameSlot componentNames[COMPONENT_NAME_TABLE_SIZE]; // Open
+                                                               // addressing
+                                                               // name lookup
   size_t entityCount;
   LinkedList *freeIndexes;
   size_t maxEntities;
   size_t entityListEnd;
   LinkedList *queries;
+  uint32_t tick; // Advanced by systems as they run, used to stamp component
+                 // changes
+  BucketCompaction compaction;
+  struct EntityHierarchy *hierarchy; // Parent/child relationships, created
+                                     // the first time a parent is set
+  struct SystemSchedule *schedule;   // Registered systems, created by the
+                                     // first BucketRegisterSystem
+
+  BitMask enabledMasks[MAX_ENTITIES]; // Copy of every entity's enabled mask
+                                      // packed together for fast scanning
 
   Entity *entities[MAX_ENTITIES]; // The array of entities to hold all added
                                   // entities (There can be NULL elements if
@@ -219,6 +715,8 @@ Bucket *BucketCreate(Arena *arena, size_t maxEntities) {
   bucket->freeIndexes = LinkedListCreate(arena);
   bucket->maxEntities = maxEntities;
   bucket->queries = LinkedListCreate(arena);
+  bucket->tick = 1; // 0 is reserved for "never" so a fresh system sees
+                    // everything as changed
 
   // allocate component arrays
   size_t pos = arena->top;
@@ -235,6 +733,10 @@ Bucket *BucketCreate(Arena *arena, size_t maxEntities) {
     component->mask = 0;
     component->componentId = 0;
     component->componentSize = 0;
+    component->isShared = 0;
+    component->sharedValues = NULL;
+    component->sharedValueCount = 0;
+    component->compactRegion = -1;
     bucket->components[i] = component;
   }
 
@@ -247,6 +749,7 @@ Bucket *BucketCreate(Arena *arena, size_t maxEntities) {
       return NULL;
     }
     entity->mask = 0;
+    entity->disabled = 0;
     entity->index = i;
     bucket->entities[i] = entity;
   }
@@ -254,6 +757,124 @@ Bucket *BucketCreate(Arena *arena, size_t maxEntities) {
   return bucket;
 }
 
+// Queries
+// ---------------------------------------------------------------------------------------------------
+
+// A registered query keeps the list of entities matching its terms up to date
+// as components are added and removed, so iterating it only costs its matches.
+// A disabled component counts as missing for every term, the same as for
+// BucketScanQuery and BucketBitsetQuery. Toggling has to stay a bit flip so
+// membership only follows the include and any terms on the components an
+// entity has, and QueryGetEntity checks every term against the enabled ones.
+// An entity with an excluded component is still in matches and count, it is
+// skipped while iterating
+
+typedef struct {
+  BitMask include;  // Components an entity needs all of
+  BitMask exclude;  // Components an entity must have none of enabled
+  BitMask any;      // Components an entity needs at least one of (ignored
+                    // when 0)
+  BitMask optional; // Components fetched if present, these never affect
+                    // matching
+} QueryTerms;
+
+typedef struct {
+  BitMask include;
+  BitMask exclude;
+  BitMask any;
+  BitMask optional;
+
+  uint32_t *matches; // Indexes of the matching entities, unordered
+  uint32_t *slots;   // For each entity its position in matches + 1, or 0 if
+                     // it doesn't match
+  HiBitSet members;  // The same set as matches, walkable in index order
+  size_t count;
+
+  size_t version; // Bumped whenever an entity joins or leaves the query
+
+  // Sorting state, see QuerySortByKey
+  struct QueryGroup *groups; // Runs of matches with equal keys once sorted
+  size_t groupCount;
+  uint32_t *sortScratch; // Keys and indexes for the radix passes
+  size_t sortedVersion;
+  size_t sortedKeyVersion; // ComponentTypeVersion of the key when sorted
+  ComponentType *sortKeyType;
+  void *sortFn; // What the current order was sorted by, so a different sort
+  void *sortUserData; // forces a re-sort
+  int sorted;
+} Query;
+
+// Whether an entity with components `mask` belongs in the query's matches.
+// Exclude is left to QueryGetEntity since it depends on what is enabled
+int QueryMatchesMask(Query *query, BitMask mask) {
+  return (mask & query->include) == query->include &&
+         (!query->any || (mask & query->any));
+}
+
+void QueryInsertEntity(Query *query, size_t entityId) {
+  if (query->slots[entityId]) {
+    return;
+  }
+  query->matches[query->count] = entityId;
+  query->slots[entityId] = ++query->count;
+  HiBitSetSet(&query->members, entityId);
+  query->version++;
+}
+
+void QueryRemoveEntity(Query *query, size_t entityId) {
+  size_t slot = query->slots[entityId];
+  if (!slot) {
+    return;
+  }
+
+  // swap the last match into the hole
+  uint32_t last = query->matches[--query->count];
+  query->matches[slot - 1] = last;
+  query->slots[last] = slot;
+  query->slots[entityId] = 0;
+  HiBitSetClear(&query->members, entityId);
+  query->version++;
+}
+
+// Every change to an entity's mask goes through here so that registered
+// queries can follow along. It is O(registered queries)
+void BucketSetEntityMask(Bucket *bucket, Entity *entity, BitMask mask) {
+  BitMask oldMask = entity->mask;
+  BitMask oldEnabled = bucket->enabledMasks[entity->index];
+  entity->mask = mask;
+  BitMask enabled = EntityEnabledMask(entity);
+  bucket->enabledMasks[entity->index] = enabled;
+
+  // keep the per component presence bitsets in step
+  for (BitMask changed = oldEnabled ^ enabled; changed;
+       changed &= changed - 1) {
+    size_t componentId = __builtin_ctzll(changed);
+    HiBitSet *presence = &bucket->components[componentId]->presence;
+    if (enabled & ((BitMask)1 << componentId)) {
+      HiBitSetSet(presence, entity->index);
+    } else {
+      HiBitSetClear(presence, entity->index);
+    }
+  }
+
+  if (oldMask == mask) {
+    return;
+  }
+
+  for (LinkedListNode *node = bucket->queries->head; node; node = node->next) {
+    Query *query = node->value;
+    int matched = QueryMatchesMask(query, oldMask);
+    int matches = QueryMatchesMask(query, mask);
+    if (matches && !matched) {
+      QueryInsertEntity(query, entity->index);
+    } else if (matched && !matches) {
+      QueryRemoveEntity(query, entity->index);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------------------------------
+
 Entity *BucketCreateEntity(Bucket *bucket) {
 
   // size_t index;
@@ -268,13 +889,17 @@ Entity *BucketCreateEntity(Bucket *bucket) {
   Entity *entity = bucket->entities[index];
 
   entity->mask = 0;
+  entity->disabled = 0;
   entity->index = index;
+  bucket->enabledMasks[index] = 0;
 
   bucket->entityCount++;
 
   return entity;
 }
 
+void BucketDetachEntity(Bucket *bucket, uint32_t entityId);
+
 void BucketDeleteEntity(Bucket *bucket, size_t index) {
   if (index < 0 || index >= bucket->entityListEnd) {
     return;
@@ -282,7 +907,20 @@ void BucketDeleteEntity(Bucket *bucket, size_t index) {
 
   Entity *entity = bucket->entities[index];
   if (entity) {
-    entity->mask = 0;
+    // shared values are reference counted so let go of any this entity holds
+    for (size_t i = 0; i < bucket->componentIdTop; i++) {
+      ComponentType *componentType = bucket->components[i];
+      if (componentType->isShared && (entity->mask & componentType->mask)) {
+        ReleaseSharedComponentValue(componentType->entries[index]);
+        componentType->entries[index] = NULL;
+      }
+    }
+    BucketSetEntityMask(bucket, entity, 0);
+    entity->disabled = 0;
+
+    if (bucket->hierarchy) {
+      BucketDetachEntity(bucket, index);
+    }
   }
 
   bucket->entityCount--;
@@ -291,23 +929,109 @@ void BucketDeleteEntity(Bucket *bucket, size_t index) {
   //
 }
 
+// Component name lookup
+// ---------------------------------------------------------------------------------------------------
+
+// Runtime lookups by name (scripting, data driven setup etc.) go through an
+// open addressing hash table in the bucket so they cost one hash and usually
+// one probe. Names are interned when their component type is registered, a
+// caller that holds on to the interned pointer skips the string compare
+// entirely
+
+// FNV-1a
+uint64_t EccHashName(const char *name) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char *c = name; *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+ComponentNameSlot *BucketFindComponentNameSlot(Bucket *bucket,
+                                               const char *name) {
+  uint64_t hash = EccHashName(name);
+  size_t mask = COMPONENT_NAME_TABLE_SIZE - 1;
+
+  for (size_t probe = 0; probe < COMPONENT_NAME_TABLE_SIZE; probe++) {
+    ComponentNameSlot *slot = &bucket->componentNames[(hash + probe) & mask];
+    if (!slot->name) {
+      return slot;
+    }
+    if (slot->name == name ||
+        (slot->hash == hash && strcmp(slot->name, name) == 0)) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+// Find a registered component type by name, NULL if there isn't one
+ComponentType *BucketGetComponentType(Bucket *bucket, char *componentName) {
+  ComponentNameSlot *slot = BucketFindComponentNameSlot(bucket, componentName);
+  return slot ? slot->componentType : NULL;
+}
+
+// Get the bucket's own copy of a registered component name. Lookups using the
+// returned pointer match by pointer without comparing strings
+char *BucketInternComponentName(Bucket *bucket, char *componentName) {
+  ComponentNameSlot *slot = BucketFindComponentNameSlot(bucket, componentName);
+  return slot ? slot->name : NULL;
+}
+
 ComponentType *BucketRegisterComponentType(Bucket *bucket, size_t size,
                                            char *name) {
 
+  ComponentNameSlot *slot = BucketFindComponentNameSlot(bucket, name);
+  if (!slot) {
+    return NULL;
+  }
+
+  if (!slot->name) {
+    size_t length = strlen(name) + 1;
+    char *interned = ArenaAllocate(bucket->arena, length);
+    if (!interned) {
+      return NULL;
+    }
+    memcpy(interned, name, length);
+    slot->hash = EccHashName(name);
+    slot->name = interned;
+  }
+
+  uint32_t *addedTicks =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+  uint32_t *changedTicks =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+  HiBitSet presence;
+  if (!addedTicks || !changedTicks ||
+      !HiBitSetInit(&presence, bucket->arena, MAX_ENTITIES)) {
+    return NULL;
+  }
+
   size_t index = bucket->componentIdTop++;
 
   ComponentType *component = bucket->components[index];
 
-  component->mask = 1 << index;
+  component->mask = (BitMask)1 << index;
   component->componentSize = size;
   component->componentId = index; // this is probably unnecessary??
-  component->name = name;
+  component->name = slot->name;
+  slot->componentType = component;
+
+  component->globalId = EccComponentIdForName(name);
+  if (component->globalId != INVALID_COMPONENT_ID) {
+    bucket->componentsByGlobalId[component->globalId] = component;
+  }
 
   for (int i = 0; i < MAX_ENTITIES; i++) {
     // Stores pointers to memory in an arena, not actual component values
     component->entries[i] = ArenaAllocate(bucket->arena, sizeof(void *));
   }
 
+  component->addedTicks = addedTicks;
+  component->changedTicks = changedTicks;
+  component->presence = presence;
+
   return component;
 }
 
@@ -323,17 +1047,25 @@ void *AddComponentToEntityById(Bucket *bucket, size_t entityId,
     return NULL;
   }
 
-  entity->mask = entity->mask | componentType->mask;
+  // shared components have no per entity storage, they are assigned a value
+  // with SetSharedComponentForEntityById instead
+  if (componentType->isShared) {
+    return NULL;
+  }
+
+  BucketSetEntityMask(bucket, entity, entity->mask | componentType->mask);
 
   void *component = ArenaAllocate(bucket->arena, componentType->componentSize);
   componentType->entries[entity->index] = component;
+  componentType->addedTicks[entity->index] = bucket->tick;
+  ComponentTypeMarkChanged(componentType, entity->index, bucket->tick);
 
   return component;
 }
 
 // Add a component to an entity. This function will also register the
-// component to the bucket if it isn't already registered. It is an O(n)
-// operation to check for existence and register the component
+// component to the bucket if it isn't already registered. Finding the
+// component type is a hash table lookup on its name
 void *AddComponentToEntity(Bucket *bucket, Entity *entity, size_t componentSize,
                            char *componentName) {
 
@@ -341,34 +1073,20 @@ void *AddComponentToEntity(Bucket *bucket, Entity *entity, size_t componentSize,
     return NULL;
   }
 
-  // iterate through component types. If we reach a NULL without finding a
-  // componentType with a matching name, it means we need to register a new
-  // one
-  for (int i = 0; i < MAX_COMPONENT_TYPES; i++) {
-    ComponentType *checkComponentType = bucket->components[i];
-    // reached an empty component type, create a new component and break out of
-    // the loop.
-    if (checkComponentType->mask == 0) {
-
-      ComponentType *componentType =
-          BucketRegisterComponentType(bucket, componentSize, componentName);
-      void *componentData =
-          AddComponentToEntityById(bucket, entity->index, componentType);
-
-      return componentData;
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    // no space to register a new component type
+    if (bucket->componentIdTop >= MAX_COMPONENT_TYPES) {
+      return NULL;
     }
-
-    // reached a component whose name matches
-    if (strcmp(checkComponentType->name, componentName) == 0) {
-      void *componentData =
-          AddComponentToEntityById(bucket, entity->index, checkComponentType);
-      return componentData;
+    componentType =
+        BucketRegisterComponentType(bucket, componentSize, componentName);
+    if (!componentType) {
+      return NULL;
     }
   }
 
-  // reached the end of the components list and didn't find a match or a space
-  // to create a new component
-  return NULL;
+  return AddComponentToEntityById(bucket, entity->index, componentType);
 }
 
 void RemoveComponentFromEntityById(Bucket *bucket, size_t entityId,
@@ -379,7 +1097,14 @@ void RemoveComponentFromEntityById(Bucket *bucket, size_t entityId,
   }
 
   Entity *entity = bucket->entities[entityId];
-  entity->mask &= ~componentType->mask;
+
+  if (componentType->isShared && (entity->mask & componentType->mask)) {
+    ReleaseSharedComponentValue(componentType->entries[entity->index]);
+  }
+
+  BucketSetEntityMask(bucket, entity, entity->mask & ~componentType->mask);
+  __atomic_fetch_and(&entity->disabled, ~componentType->mask,
+                     __ATOMIC_RELAXED);
 
   componentType->entries[entity->index] =
       NULL; // probably don't actually have to do this as it's no longer in
@@ -388,8 +1113,7 @@ void RemoveComponentFromEntityById(Bucket *bucket, size_t entityId,
 }
 
 // Remove a component from an entity. This function will search for the
-// component by its name . It is an O(n) operation to check for existence and
-// remove the component
+// component by its name in the bucket's hash table
 
 void RemoveComponentFromEntity(Bucket *bucket, Entity *entity,
                                char *componentName) {
@@ -397,25 +1121,21 @@ void RemoveComponentFromEntity(Bucket *bucket, Entity *entity,
     return;
   }
 
-  for (int i = 0; i < MAX_COMPONENT_TYPES; i++) {
-    ComponentType *checkComponentType = bucket->components[i];
-    // we've reached the end of the list, return early as there's no component
-    // with that name registered
-    if (checkComponentType->mask == 0) {
-      return;
-    }
-
-    if (strcmp(checkComponentType->name, componentName) == 0) {
-      RemoveComponentFromEntityById(bucket, entity->index, checkComponentType);
-      return;
-    }
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    return;
   }
-  return;
+
+  RemoveComponentFromEntityById(bucket, entity->index, componentType);
 }
 
+// Shared component types are not handed out here, a writable pointer to a
+// shared value would let one entity change it for every entity holding it. Use
+// GetSharedComponentForEntityById to read them
 void *GetComponentForEntityById(Bucket *bucket, size_t entityId,
                                 ComponentType *componentType) {
-  if (entityId < 0 || entityId > bucket->entityListEnd) {
+  if (entityId < 0 || entityId > bucket->entityListEnd ||
+      componentType->isShared) {
     return NULL;
   }
 
@@ -429,26 +1149,3465 @@ void *GetComponentForEntityById(Bucket *bucket, size_t entityId,
 }
 
 // Get a component for an entity. This function will search for the component by
-// its name . It is an O(n) operation to check for existence and return the
-// component
+// its name in the bucket's hash table
 void *GetComponentForEntity(Bucket *bucket, Entity *entity,
                             char *componentName) {
   if (!entity || entity->index < 0 || entity->index > MAX_ENTITIES) {
     return NULL;
   }
 
-  for (int i = 0; i < MAX_COMPONENT_TYPES; i++) {
-    ComponentType *checkComponentType = bucket->components[i];
-    // we've reached the end of the list, return early as there's no component
-    // with that name registered
-    if (checkComponentType->mask == 0) {
-      return NULL;
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    return NULL;
+  }
+
+  return GetComponentForEntityById(bucket, entity->index, componentType);
+}
+
+// Shared components
+// ---------------------------------------------------------------------------------------------------
+
+// Shared components store one copy of each distinct value and let any number of
+// entities point at it. This is useful for things like render materials or
+// scales that are identical across lots of entities. Values are compared
+// byte-wise so component structs should be zero initialised before being set
+// (padding included) to deduplicate reliably
+
+ComponentType *BucketRegisterSharedComponentType(Bucket *bucket, size_t size,
+                                                 char *name) {
+  ComponentType *componentType = BucketRegisterComponentType(bucket, size, name);
+  if (componentType) {
+    componentType->isShared = 1;
+  }
+  return componentType;
+}
+
+// Find a value equal to `value` or create one. Unused values are recycled
+// before anything new is taken from the arena
+SharedComponentValue *InternSharedComponentValue(Bucket *bucket,
+                                                 ComponentType *componentType,
+                                                 const void *value) {
+  SharedComponentValue *unused = NULL;
+
+  for (SharedComponentValue *check = componentType->sharedValues; check;
+       check = check->next) {
+    if (check->refCount == 0) {
+      if (!unused) {
+        unused = check;
+      }
+      continue;
     }
 
-    if (strcmp(checkComponentType->name, componentName) == 0) {
-      return GetComponentForEntityById(bucket, entity->index,
-                                       checkComponentType);
+    if (memcmp(check->data, value, componentType->componentSize) == 0) {
+      return check;
+    }
+  }
+
+  if (unused) {
+    memcpy(unused->data, value, componentType->componentSize);
+    return unused;
+  }
+
+  SharedComponentValue *created = ArenaAllocate(
+      bucket->arena,
+      sizeof(SharedComponentValue) + componentType->componentSize);
+  if (!created) {
+    return NULL;
+  }
+
+  memcpy(created->data, value, componentType->componentSize);
+  created->id = componentType->sharedValueCount++;
+  created->next = componentType->sharedValues;
+  componentType->sharedValues = created;
+
+  return created;
+}
+
+// Turn a registered type into a shared one. Building a mask or a query
+// registers the types it names as plain ones, so a type can only be known to
+// be shared once it is first set. Returns 0 if some entity already has a plain
+// instance of it
+int ComponentTypeMakeShared(Bucket *bucket, ComponentType *componentType) {
+  if (componentType->isShared) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    if (bucket->entities[i]->mask & componentType->mask) {
+      return 0;
+    }
+  }
+
+  componentType->isShared = 1;
+  return 1;
+}
+
+const void *SetSharedComponentForEntityById(Bucket *bucket, size_t entityId,
+                                            ComponentType *componentType,
+                                            const void *value) {
+  if (entityId < 0 || entityId > bucket->entityListEnd ||
+      !ComponentTypeMakeShared(bucket, componentType)) {
+    return NULL;
+  }
+
+  Entity *entity = bucket->entities[entityId];
+
+  // take the reference before releasing the old one so setting an entity to
+  // the value it already has can't recycle that value out from under it
+  SharedComponentValue *shared =
+      InternSharedComponentValue(bucket, componentType, value);
+  if (!shared) {
+    return NULL;
+  }
+  shared->refCount++;
+
+  if (entity->mask & componentType->mask) {
+    ReleaseSharedComponentValue(componentType->entries[entityId]);
+  }
+
+  if (!(entity->mask & componentType->mask)) {
+    componentType->addedTicks[entityId] = bucket->tick;
+  }
+  ComponentTypeMarkChanged(componentType, entityId, bucket->tick);
+
+  componentType->entries[entityId] = shared->data;
+  BucketSetEntityMask(bucket, entity, entity->mask | componentType->mask);
+
+  return shared->data;
+}
+
+// Copy on write access to a shared component. If the entity is the only one
+// using its value it is returned as is, otherwise the entity is moved onto a
+// private copy that can be changed without affecting anyone else
+void *GetMutableSharedComponentForEntityById(Bucket *bucket, size_t entityId,
+                                             ComponentType *componentType) {
+  if (entityId < 0 || entityId > bucket->entityListEnd ||
+      !componentType->isShared) {
+    return NULL;
+  }
+
+  Entity *entity = bucket->entities[entityId];
+  if (!(entity->mask & componentType->mask)) {
+    return NULL;
+  }
+
+  ComponentTypeMarkChanged(componentType, entityId, bucket->tick);
+
+  SharedComponentValue *current =
+      SharedComponentValueFromData(componentType->entries[entityId]);
+  if (current->refCount == 1) {
+    return current->data;
+  }
+
+  // interning would just hand back the value we're already on, so pick an
+  // unused one or make a fresh one by hand
+  SharedComponentValue *copy = NULL;
+  for (SharedComponentValue *check = componentType->sharedValues; check;
+       check = check->next) {
+    if (check->refCount == 0) {
+      copy = check;
+      break;
+    }
+  }
+
+  if (!copy) {
+    copy = ArenaAllocate(bucket->arena, sizeof(SharedComponentValue) +
+                                            componentType->componentSize);
+    if (!copy) {
+      return NULL;
+    }
+    copy->id = componentType->sharedValueCount++;
+    copy->next = componentType->sharedValues;
+    componentType->sharedValues = copy;
+  }
+
+  memcpy(copy->data, current->data, componentType->componentSize);
+  copy->refCount = 1;
+  current->refCount--;
+  componentType->entries[entityId] = copy->data;
+
+  return copy->data;
+}
+
+// Read only access to a shared component, writes have to go through
+// GetMutableSharedComponentForEntityById so they get copied first
+const void *GetSharedComponentForEntityById(Bucket *bucket, size_t entityId,
+                                            ComponentType *componentType) {
+  if (entityId < 0 || entityId > bucket->entityListEnd ||
+      !componentType->isShared) {
+    return NULL;
+  }
+
+  Entity *entity = bucket->entities[entityId];
+  if (!(entity->mask & componentType->mask)) {
+    return NULL;
+  }
+
+  return componentType->entries[entityId];
+}
+
+SharedComponentValue *GetSharedComponentValueForEntityById(
+    Bucket *bucket, size_t entityId, ComponentType *componentType) {
+  const void *data =
+      GetSharedComponentForEntityById(bucket, entityId, componentType);
+  if (!data) {
+    return NULL;
+  }
+  return SharedComponentValueFromData((void *)data);
+}
+
+// Set a shared component on an entity by name, registering the component type
+// as shared if it isn't already registered
+const void *SetSharedComponentForEntity(Bucket *bucket, Entity *entity,
+                                        size_t componentSize,
+                                        char *componentName, const void *value) {
+  if (!entity || entity->index < 0 || entity->index > MAX_ENTITIES) {
+    return NULL;
+  }
+
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    if (bucket->componentIdTop >= MAX_COMPONENT_TYPES) {
+      return NULL;
+    }
+    componentType =
+        BucketRegisterSharedComponentType(bucket, componentSize, componentName);
+    if (!componentType) {
+      return NULL;
+    }
+  }
+
+  return SetSharedComponentForEntityById(bucket, entity->index, componentType,
+                                         value);
+}
+
+const void *GetSharedComponentForEntity(Bucket *bucket, Entity *entity,
+                                        char *componentName) {
+  if (!entity || entity->index < 0 || entity->index > MAX_ENTITIES) {
+    return NULL;
+  }
+
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    return NULL;
+  }
+
+  return GetSharedComponentForEntityById(bucket, entity->index, componentType);
+}
+
+void *GetMutableSharedComponentForEntity(Bucket *bucket, Entity *entity,
+                                         char *componentName) {
+  if (!entity || entity->index < 0 || entity->index > MAX_ENTITIES) {
+    return NULL;
+  }
+
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    return NULL;
+  }
+
+  return GetMutableSharedComponentForEntityById(bucket, entity->index,
+                                                componentType);
+}
+
+typedef struct {
+  SharedComponentValue *value; // The shared value every entity in the group has
+  size_t start; // Offset of the group's first entity in the indexes array
+  size_t count;
+} SharedComponentGroup;
+
+// Collect every entity that has all of the components in `include` and groups
+// them by their value of `sharedType`. `indexes` is filled with entity indexes
+// ordered group by group and needs room for entityListEnd entries, `groups`
+// needs room for sharedType->sharedValueCount entries. Returns the number of
+// non-empty groups written
+size_t BucketGroupBySharedComponent(Bucket *bucket, BitMask include,
+                                    ComponentType *sharedType, size_t *indexes,
+                                    SharedComponentGroup *groups) {
+  if (!sharedType->isShared) {
+    return 0;
+  }
+
+  include |= sharedType->mask;
+
+  for (size_t i = 0; i < sharedType->sharedValueCount; i++) {
+    groups[i] = (SharedComponentGroup){0};
+  }
+
+  for (SharedComponentValue *value = sharedType->sharedValues; value;
+       value = value->next) {
+    groups[value->id].value = value;
+  }
+
+  // counting sort on the value ids, first count then place
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    Entity *entity = bucket->entities[i];
+    if ((EntityEnabledMask(entity) & include) != include) {
+      continue;
+    }
+    groups[SharedComponentValueFromData(sharedType->entries[i])->id].count++;
+  }
+
+  size_t start = 0;
+  for (size_t i = 0; i < sharedType->sharedValueCount; i++) {
+    groups[i].start = start;
+    start += groups[i].count;
+    groups[i].count = 0;
+  }
+
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    Entity *entity = bucket->entities[i];
+    if ((EntityEnabledMask(entity) & include) != include) {
+      continue;
+    }
+    SharedComponentGroup *group =
+        &groups[SharedComponentValueFromData(sharedType->entries[i])->id];
+    indexes[group->start + group->count++] = i;
+  }
+
+  // squash out values nobody matched
+  size_t groupCount = 0;
+  for (size_t i = 0; i < sharedType->sharedValueCount; i++) {
+    if (groups[i].count > 0) {
+      groups[groupCount++] = groups[i];
+    }
+  }
+
+  return groupCount;
+}
+
+// Change ticks
+// ---------------------------------------------------------------------------------------------------
+
+// Every component slot remembers the bucket tick it was added at and the tick
+// it was last fetched for writing. A system that remembers the tick it last ran
+// at can then skip everything that hasn't been touched since. Systems should
+// advance the tick when they start running so that their own writes are
+// stamped with the tick they remember and don't show up next time
+
+typedef enum {
+  COMPONENT_ADDED,
+  COMPONENT_CHANGED, // Added or fetched mutably
+} ComponentChangeFilter;
+
+// Returns the new tick which the caller should keep as its "last ran" tick
+uint32_t BucketAdvanceTick(Bucket *bucket) {
+  bucket->tick++;
+  // skip 0 on wrap around, it means never
+  if (bucket->tick == 0) {
+    bucket->tick++;
+  }
+  return bucket->tick;
+}
+
+// Tick comparison that survives the counter wrapping around
+int TickIsNewer(uint32_t tick, uint32_t sinceTick) {
+  return (int32_t)(tick - sinceTick) > 0;
+}
+
+int ComponentAddedSince(ComponentType *componentType, size_t entityId,
+                        uint32_t sinceTick) {
+  return TickIsNewer(componentType->addedTicks[entityId], sinceTick);
+}
+
+int ComponentChangedSince(ComponentType *componentType, size_t entityId,
+                          uint32_t sinceTick) {
+  return TickIsNewer(componentType->changedTicks[entityId], sinceTick);
+}
+
+void *GetMutableComponentForEntityById(Bucket *bucket, size_t entityId,
+                                       ComponentType *componentType) {
+  if (componentType->isShared) {
+    return GetMutableSharedComponentForEntityById(bucket, entityId,
+                                                  componentType);
+  }
+
+  void *component = GetComponentForEntityById(bucket, entityId, componentType);
+  if (component) {
+    ComponentTypeMarkChanged(componentType, entityId, bucket->tick);
+  }
+  return component;
+}
+
+void *GetMutableComponentForEntity(Bucket *bucket, Entity *entity,
+                                   char *componentName) {
+  if (!entity || entity->index < 0 || entity->index > MAX_ENTITIES) {
+    return NULL;
+  }
+
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    return NULL;
+  }
+
+  return GetMutableComponentForEntityById(bucket, entity->index,
+                                          componentType);
+}
+
+// Collect the indexes of entities that have every component in `include` and
+// whose `componentType` was added (or changed, depending on `filter`) after
+// `sinceTick`. `indexes` needs room for entityListEnd entries. Returns the
+// number of indexes written
+size_t BucketQueryChanged(Bucket *bucket, BitMask include,
+                          ComponentType *componentType,
+                          ComponentChangeFilter filter, uint32_t sinceTick,
+                          size_t *indexes) {
+  include |= componentType->mask;
+  uint32_t *ticks = filter == COMPONENT_ADDED ? componentType->addedTicks
+                                              : componentType->changedTicks;
+
+  size_t count = 0;
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    Entity *entity = bucket->entities[i];
+    if ((EntityEnabledMask(entity) & include) != include) {
+      continue;
+    }
+    if (TickIsNewer(ticks[i], sinceTick)) {
+      indexes[count++] = i;
+    }
+  }
+
+  return count;
+}
+
+// Enabling and disabling components
+// ---------------------------------------------------------------------------------------------------
+
+// Disabling a component hides it from queries without removing it, the data
+// stays where it is and can still be fetched directly. Toggling is a single
+// atomic bit flip on the entity so it is safe to do from parallel systems and
+// never allocates
+
+void SetComponentEnabledForEntityById(Bucket *bucket, size_t entityId,
+                                      ComponentType *componentType,
+                                      int enabled) {
+  if (entityId < 0 || entityId > bucket->entityListEnd) {
+    return;
+  }
+
+  Entity *entity = bucket->entities[entityId];
+
+  if (enabled) {
+    __atomic_fetch_and(&entity->disabled, ~componentType->mask,
+                       __ATOMIC_RELAXED);
+    if (entity->mask & componentType->mask) {
+      __atomic_fetch_or(&bucket->enabledMasks[entityId], componentType->mask,
+                        __ATOMIC_RELAXED);
+      HiBitSetSet(&componentType->presence, entityId);
+    }
+  } else {
+    __atomic_fetch_or(&entity->disabled, componentType->mask,
+                      __ATOMIC_RELAXED);
+    __atomic_fetch_and(&bucket->enabledMasks[entityId], ~componentType->mask,
+                       __ATOMIC_RELAXED);
+    HiBitSetClearAtomic(&componentType->presence, entityId);
+  }
+}
+
+// Returns 1 if the entity has the component and it isn't disabled
+int IsComponentEnabledForEntityById(Bucket *bucket, size_t entityId,
+                                    ComponentType *componentType) {
+  if (entityId < 0 || entityId > bucket->entityListEnd) {
+    return 0;
+  }
+
+  Entity *entity = bucket->entities[entityId];
+  return (EntityEnabledMask(entity) & componentType->mask) != 0;
+}
+
+void SetComponentEnabledForEntity(Bucket *bucket, Entity *entity,
+                                  char *componentName, int enabled) {
+  if (!entity || entity->index < 0 || entity->index > MAX_ENTITIES) {
+    return;
+  }
+
+  ComponentType *componentType = BucketGetComponentType(bucket, componentName);
+  if (!componentType) {
+    return;
+  }
+
+  SetComponentEnabledForEntityById(bucket, entity->index, componentType,
+                                   enabled);
+}
+
+// Compaction
+// ---------------------------------------------------------------------------------------------------
+
+// Every component is its own arena allocation so after a lot of adding and
+// removing the components of one type end up scattered all over the arena.
+// Compaction copies the live components of each type into one contiguous
+// region in entity index order. It is incremental, each call does as much as
+// fits in its time budget and the next call carries on from there.
+//
+// Moving a component invalidates any pointer to it held outside the bucket.
+// The entries arrays are always kept up to date so re-fetching with the GET
+// functions after compacting is safe, anything else should register a
+// relocation callback.
+//
+// Each type alternates between two regions, a region is only reused once a
+// full pass over the type has moved everything out of it. The arena can't
+// free so space lost to scattered components isn't reclaimed, compaction is
+// about locality rather than memory
+
+uint64_t EccNowNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void BucketSetRelocationCallback(Bucket *bucket,
+                                 ComponentRelocatedFn onRelocate,
+                                 void *userData) {
+  bucket->compaction.onRelocate = onRelocate;
+  bucket->compaction.userData = userData;
+}
+
+// Move on to the next component type, returns 1 once every type has been
+// visited
+int CompactionNextType(Bucket *bucket) {
+  BucketCompaction *compaction = &bucket->compaction;
+  compaction->typeIndex++;
+  compaction->phase = COMPACTION_SCAN;
+  compaction->entityCursor = 0;
+  compaction->liveCount = 0;
+  compaction->scatteredCount = 0;
+  compaction->lastPayload = NULL;
+
+  if (compaction->typeIndex >= bucket->componentIdTop) {
+    compaction->typeIndex = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Pick the region to compact into, growing it from the arena if it's too
+// small. Returns 0 if the arena can't fit it
+int CompactionPrepareTarget(Bucket *bucket, ComponentType *componentType) {
+  BucketCompaction *compaction = &bucket->compaction;
+  int target = componentType->compactRegion == 0 ? 1 : 0;
+
+  if (componentType->compactRegionCapacity[target] < compaction->liveCount) {
+    // leave some room for components added while the pass is running
+    size_t capacity = compaction->liveCount + compaction->liveCount / 4 + 16;
+    char *region = ArenaAllocate(bucket->arena,
+                                 capacity * componentType->componentSize);
+    if (!region) {
+      return 0;
+    }
+    componentType->compactRegions[target] = region;
+    componentType->compactRegionCapacity[target] = capacity;
+  }
+
+  compaction->targetRegion = target;
+  compaction->targetTop = 0;
+  return 1;
+}
+
+// Run compaction for up to budgetNs nanoseconds (0 means no limit). Returns 1
+// when this call finished a full pass over every component type
+int BucketCompact(Bucket *bucket, uint64_t budgetNs) {
+  BucketCompaction *compaction = &bucket->compaction;
+  uint64_t deadline = budgetNs ? EccNowNs() + budgetNs : 0;
+
+  if (bucket->componentIdTop == 0) {
+    return 1;
+  }
+
+  size_t steps = 0;
+  for (;;) {
+    // checking the clock is comparatively expensive so only do it every so
+    // often
+    if (deadline && (++steps & 63) == 0 && EccNowNs() >= deadline) {
+      return 0;
+    }
+
+    ComponentType *componentType = bucket->components[compaction->typeIndex];
+    size_t size = componentType->componentSize;
+
+    // shared values are already deduplicated and there is nothing to gain
+    // from moving them
+    if (componentType->isShared || size == 0) {
+      if (CompactionNextType(bucket)) {
+        return 1;
+      }
+      continue;
+    }
+
+    size_t i = compaction->entityCursor;
+
+    if (i >= bucket->entityListEnd) {
+      if (compaction->phase == COMPACTION_SCAN) {
+        // already in order, leave it be
+        if (compaction->scatteredCount <= 1 ||
+            !CompactionPrepareTarget(bucket, componentType)) {
+          if (CompactionNextType(bucket)) {
+            return 1;
+          }
+          continue;
+        }
+        compaction->phase = COMPACTION_MOVE;
+        compaction->entityCursor = 0;
+        continue;
+      }
+
+      // everything live has been moved out of the old region so it can be
+      // compacted into next time
+      componentType->compactRegion = compaction->targetRegion;
+      if (CompactionNextType(bucket)) {
+        return 1;
+      }
+      continue;
+    }
+
+    compaction->entityCursor++;
+
+    Entity *entity = bucket->entities[i];
+    if (!(entity->mask & componentType->mask)) {
+      continue;
+    }
+
+    char *payload = componentType->entries[i];
+
+    if (compaction->phase == COMPACTION_SCAN) {
+      if (payload != compaction->lastPayload + size) {
+        compaction->scatteredCount++;
+      }
+      compaction->lastPayload = payload;
+      compaction->liveCount++;
+      continue;
+    }
+
+    int target = compaction->targetRegion;
+    if (compaction->targetTop >= componentType->compactRegionCapacity[target]) {
+      // more was added mid pass than we left room for. Whatever is still in
+      // the other region can't be moved now so that region is given up on
+      // rather than risk compacting over live components later
+      int other = target == 0 ? 1 : 0;
+      componentType->compactRegions[other] = NULL;
+      componentType->compactRegionCapacity[other] = 0;
+      componentType->compactRegion = target;
+      if (CompactionNextType(bucket)) {
+        return 1;
+      }
+      continue;
+    }
+
+    char *moved = componentType->compactRegions[target] +
+                  compaction->targetTop++ * size;
+    memcpy(moved, payload, size);
+    componentType->entries[i] = moved;
+
+    if (compaction->onRelocate) {
+      compaction->onRelocate(componentType, i, payload, moved,
+                             compaction->userData);
+    }
+  }
+}
+
+// Component id lookups
+// ---------------------------------------------------------------------------------------------------
+
+// These back the macros. Resolving a component id to the bucket's component
+// type is a single indexed load, there's no string work once COMPONENT_ID has
+// cached the id
+
+ComponentType *BucketComponentTypeForComponentId(Bucket *bucket,
+                                                 size_t componentId) {
+  if (componentId >= MAX_COMPONENT_NAMES) {
+    return NULL;
+  }
+  return bucket->componentsByGlobalId[componentId];
+}
+
+// Same as BucketComponentTypeForComponentId but registers the component type
+// with the bucket the first time it's used
+ComponentType *BucketComponentTypeForComponentIdOrRegister(Bucket *bucket,
+                                                           size_t componentId,
+                                                           size_t size,
+                                                           int isShared) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (componentType || componentId >= MAX_COMPONENT_NAMES ||
+      bucket->componentIdTop >= MAX_COMPONENT_TYPES) {
+    return componentType;
+  }
+
+  char *name = eccComponentNames[componentId];
+  return isShared ? BucketRegisterSharedComponentType(bucket, size, name)
+                  : BucketRegisterComponentType(bucket, size, name);
+}
+
+void *AddComponentToEntityByComponentId(Bucket *bucket, Entity *entity,
+                                        size_t componentSize,
+                                        size_t componentId) {
+  if (!entity) {
+    return NULL;
+  }
+
+  ComponentType *componentType = BucketComponentTypeForComponentIdOrRegister(
+      bucket, componentId, componentSize, 0);
+  if (!componentType) {
+    return NULL;
+  }
+
+  return AddComponentToEntityById(bucket, entity->index, componentType);
+}
+
+void *GetComponentForEntityByComponentId(Bucket *bucket, Entity *entity,
+                                         size_t componentId) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (!entity || !componentType) {
+    return NULL;
+  }
+
+  return GetComponentForEntityById(bucket, entity->index, componentType);
+}
+
+void *GetMutableComponentForEntityByComponentId(Bucket *bucket, Entity *entity,
+                                                size_t componentId) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (!entity || !componentType) {
+    return NULL;
+  }
+
+  return GetMutableComponentForEntityById(bucket, entity->index,
+                                          componentType);
+}
+
+void RemoveComponentFromEntityByComponentId(Bucket *bucket, Entity *entity,
+                                            size_t componentId) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (!entity || !componentType) {
+    return;
+  }
+
+  RemoveComponentFromEntityById(bucket, entity->index, componentType);
+}
+
+void SetComponentEnabledForEntityByComponentId(Bucket *bucket, Entity *entity,
+                                               size_t componentId,
+                                               int enabled) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (!entity || !componentType) {
+    return;
+  }
+
+  SetComponentEnabledForEntityById(bucket, entity->index, componentType,
+                                   enabled);
+}
+
+const void *SetSharedComponentForEntityByComponentId(Bucket *bucket,
+                                                     Entity *entity,
+                                                     size_t componentSize,
+                                                     size_t componentId,
+                                                     const void *value) {
+  if (!entity) {
+    return NULL;
+  }
+
+  ComponentType *componentType = BucketComponentTypeForComponentIdOrRegister(
+      bucket, componentId, componentSize, 1);
+  if (!componentType) {
+    return NULL;
+  }
+
+  return SetSharedComponentForEntityById(bucket, entity->index, componentType,
+                                         value);
+}
+
+void *GetMutableSharedComponentForEntityByComponentId(Bucket *bucket,
+                                                      Entity *entity,
+                                                      size_t componentId) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (!entity || !componentType) {
+    return NULL;
+  }
+
+  return GetMutableSharedComponentForEntityById(bucket, entity->index,
+                                                componentType);
+}
+
+const void *GetSharedComponentForEntityByComponentId(Bucket *bucket,
+                                                     Entity *entity,
+                                                     size_t componentId) {
+  ComponentType *componentType =
+      BucketComponentTypeForComponentId(bucket, componentId);
+  if (!entity || !componentType) {
+    return NULL;
+  }
+
+  return GetSharedComponentForEntityById(bucket, entity->index, componentType);
+}
+
+// Multi component fetch
+// ---------------------------------------------------------------------------------------------------
+
+// Systems usually need several components of the same entity. Fetching them
+// together validates the entity and checks its mask once instead of once per
+// component
+
+// Fill out[i] with the entity's component of types[i]. Returns 1 if the entity
+// has every one of them, otherwise 0 and out is left NULL. Shared types are
+// refused for the same reason GetComponentForEntityById refuses them
+int GetComponentsForEntityById(Bucket *bucket, size_t entityId,
+                               ComponentType **types, size_t count,
+                               void **out) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = NULL;
+  }
+
+  if (entityId < 0 || entityId > bucket->entityListEnd) {
+    return 0;
+  }
+
+  BitMask required = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!types[i] || types[i]->isShared) {
+      return 0;
+    }
+    required |= types[i]->mask;
+  }
+
+  Entity *entity = bucket->entities[entityId];
+  if ((entity->mask & required) != required) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    out[i] = types[i]->entries[entityId];
+  }
+
+  return 1;
+}
+
+int GetComponentsForEntityByComponentIds(Bucket *bucket, Entity *entity,
+                                         size_t *componentIds, size_t count,
+                                         void **out) {
+  ComponentType *types[count];
+  for (size_t i = 0; i < count; i++) {
+    types[i] = BucketComponentTypeForComponentId(bucket, componentIds[i]);
+  }
+
+  if (!entity) {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = NULL;
+    }
+    return 0;
+  }
+
+  return GetComponentsForEntityById(bucket, entity->index, types, count, out);
+}
+
+// Same as GetComponentsForEntityById, and the first `writeCount` types are
+// stamped as changed like a mutable get would
+int GetMutableComponentsForEntityById(Bucket *bucket, size_t entityId,
+                                      ComponentType **types, size_t count,
+                                      size_t writeCount, void **out) {
+  if (!GetComponentsForEntityById(bucket, entityId, types, count, out)) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < writeCount && i < count; i++) {
+    ComponentTypeMarkChanged(types[i], entityId, bucket->tick);
+  }
+  return 1;
+}
+
+int GetMutableComponentsForEntityByComponentIds(Bucket *bucket,
+                                                Entity *entity,
+                                                size_t *componentIds,
+                                                size_t count,
+                                                size_t writeCount,
+                                                void **out) {
+  ComponentType *types[count];
+  for (size_t i = 0; i < count; i++) {
+    types[i] = BucketComponentTypeForComponentId(bucket, componentIds[i]);
+  }
+
+  if (!entity) {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = NULL;
+    }
+    return 0;
+  }
+
+  return GetMutableComponentsForEntityById(bucket, entity->index, types, count,
+                                           writeCount, out);
+}
+
+// Registered queries
+// ---------------------------------------------------------------------------------------------------
+
+BitMask BucketComponentMaskForComponentIds(Bucket *bucket, size_t *componentIds,
+                                           size_t *componentSizes,
+                                           size_t count) {
+  BitMask mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    ComponentType *componentType = BucketComponentTypeForComponentIdOrRegister(
+        bucket, componentIds[i], componentSizes[i], 0);
+    if (componentType) {
+      mask |= componentType->mask;
+    }
+  }
+  return mask;
+}
+
+// Register a query that the bucket keeps up to date from now on. The initial
+// matches are found with a single scan over the entities
+// Terms need at least one include or any component, anything else would
+// match every unused entity slot too
+Query *BucketRegisterQueryWithTerms(Bucket *bucket, QueryTerms terms) {
+  if ((!terms.include && !terms.any) ||
+      bucket->queries->length >= MAX_QUERIES) {
+    return NULL;
+  }
+
+  size_t pos = bucket->arena->top;
+
+  Query *query = ArenaAllocate(bucket->arena, sizeof(Query));
+  uint32_t *matches =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+  uint32_t *slots =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+
+  if (!query || !matches || !slots ||
+      !HiBitSetInit(&query->members, bucket->arena, MAX_ENTITIES) ||
+      !LinkedListPush(bucket->queries, query)) {
+    bucket->arena->top = pos;
+    return NULL;
+  }
+
+  query->include = terms.include;
+  query->exclude = terms.exclude;
+  query->any = terms.any;
+  query->optional = terms.optional;
+  query->matches = matches;
+  query->slots = slots;
+
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    if (QueryMatchesMask(query, bucket->entities[i]->mask)) {
+      QueryInsertEntity(query, i);
+    }
+  }
+
+  return query;
+}
+
+Query *BucketRegisterQuery(Bucket *bucket, BitMask include) {
+  return BucketRegisterQueryWithTerms(bucket, (QueryTerms){.include = include});
+}
+
+// Get the i'th match of a query. Returns NULL if disabled components mean the
+// entity no longer satisfies the query so callers can just skip it
+//
+//   for (size_t i = 0; i < query->count; i++) {
+//     Entity *entity = QueryGetEntity(bucket, query, i);
+//     if (!entity) {
+//       continue;
+//     }
+//     ...
+Entity *QueryGetEntity(Bucket *bucket, Query *query, size_t i) {
+  Entity *entity = bucket->entities[query->matches[i]];
+  BitMask enabled = EntityEnabledMask(entity);
+  if ((enabled & query->include) != query->include ||
+      (enabled & query->exclude) ||
+      (query->any && !(enabled & query->any))) {
+    return NULL;
+  }
+  return entity;
+}
+
+// Span iteration
+// ---------------------------------------------------------------------------------------------------
+
+// Rather than handing out one entity at a time, span iteration hands out runs
+// of entities whose components sit at a fixed stride from each other. A system
+// can then loop over a plain count with no lookups in the loop body, which is
+// something the compiler can vectorise:
+//
+//   ComponentType *types[] = {positionType, velocityType};
+//   QuerySpanIterator it = QueryIterateSpans(bucket, query, types, 2);
+//   QuerySpan span;
+//   while (QuerySpanNext(&it, &span)) {
+//     for (size_t k = 0; k < span.count; k++) {
+//       Position *position = SPAN_COMPONENT(span, 0, Position, k);
+//       ...
+//
+// The stride of each component is its size when the components are laid out
+// back to back, or 0 when every entity in the span shares one value (treat
+// those as read only, see GET_SHARED_COMPONENT_FROM_ENTITY). Optional
+// components of a query that an entity doesn't have come through as NULL with
+// a stride of 0, a span never mixes entities with and without one. How long
+// the spans are depends on the layout, BucketCompact makes them as long as
+// possible but callers never need to know
+
+#ifndef MAX_SPAN_COMPONENTS
+#define MAX_SPAN_COMPONENTS 8
+#endif
+
+typedef struct {
+  size_t count;
+  const uint32_t *entityIndexes; // The entities in this span
+  void *components[MAX_SPAN_COMPONENTS]; // Component of the first entity
+  size_t strides[MAX_SPAN_COMPONENTS]; // Bytes between consecutive entities
+} QuerySpan;
+
+typedef struct {
+  Bucket *bucket;
+  const uint32_t *indexes;
+  size_t count;
+  size_t cursor;
+  ComponentType *types[MAX_SPAN_COMPONENTS];
+  size_t typeCount;
+  BitMask required; // Components every entity in a span must have enabled
+  BitMask optional; // Components that are NULL when missing or disabled
+  BitMask any;      // At least one of these has to be enabled
+  BitMask exclude;  // None of these may be enabled
+} QuerySpanIterator;
+
+// Iterate spans over an arbitrary list of entity indexes
+QuerySpanIterator IndexesIterateSpans(Bucket *bucket, const uint32_t *indexes,
+                                      size_t count, ComponentType **types,
+                                      size_t typeCount) {
+  QuerySpanIterator it = {0};
+  it.bucket = bucket;
+  it.indexes = indexes;
+  it.count = count;
+
+  if (typeCount > MAX_SPAN_COMPONENTS) {
+    // nothing sensible to hand out, leave the iterator empty
+    it.count = 0;
+    return it;
+  }
+
+  it.typeCount = typeCount;
+  for (size_t i = 0; i < typeCount; i++) {
+    it.types[i] = types[i];
+    if (!types[i]) {
+      it.count = 0;
+      continue;
+    }
+    it.required |= types[i]->mask;
+  }
+
+  return it;
+}
+
+QuerySpanIterator QueryIterateSpans(Bucket *bucket, Query *query,
+                                    ComponentType **types, size_t typeCount) {
+  QuerySpanIterator it = IndexesIterateSpans(bucket, query->matches,
+                                             query->count, types, typeCount);
+
+  // any-of and optional components may be missing on a given entity so they
+  // can't be required
+  it.optional = it.required & (query->optional | query->any);
+  it.required = (it.required & ~it.optional) | query->include;
+  it.any = query->any;
+  it.exclude = query->exclude;
+  return it;
+}
+
+QuerySpanIterator QueryIterateSpansByComponentIds(Bucket *bucket, Query *query,
+                                                  size_t *componentIds,
+                                                  size_t count) {
+  ComponentType *types[count];
+  for (size_t i = 0; i < count; i++) {
+    types[i] = BucketComponentTypeForComponentId(bucket, componentIds[i]);
+  }
+  return QueryIterateSpans(bucket, query, types, count);
+}
+
+int SpanEntityUsable(QuerySpanIterator *it, uint32_t entityId) {
+  BitMask enabled = EntityEnabledMask(it->bucket->entities[entityId]);
+  return (enabled & it->required) == it->required &&
+         !(enabled & it->exclude) && (!it->any || (enabled & it->any));
+}
+
+char *SpanComponent(QuerySpanIterator *it, size_t t, uint32_t entityId) {
+  ComponentType *componentType = it->types[t];
+  if ((componentType->mask & it->optional) &&
+      !(EntityEnabledMask(it->bucket->entities[entityId]) &
+        componentType->mask)) {
+    return NULL;
+  }
+  return componentType->entries[entityId];
+}
+
+// Fill `span` with the next run of entities. Returns 0 once the iterator is
+// exhausted
+int QuerySpanNext(QuerySpanIterator *it, QuerySpan *span) {
+  // skip anything with a disabled or missing component
+  while (it->cursor < it->count &&
+         !SpanEntityUsable(it, it->indexes[it->cursor])) {
+    it->cursor++;
+  }
+
+  if (it->cursor >= it->count) {
+    return 0;
+  }
+
+  size_t start = it->cursor;
+  uint32_t first = it->indexes[start];
+
+  span->entityIndexes = it->indexes + start;
+  for (size_t t = 0; t < it->typeCount; t++) {
+    span->components[t] = SpanComponent(it, t, first);
+  }
+
+  size_t count = 1;
+
+  // the second entity decides the strides, the rest have to follow them
+  if (start + 1 < it->count && SpanEntityUsable(it, it->indexes[start + 1])) {
+    uint32_t second = it->indexes[start + 1];
+    int strided = 1;
+    for (size_t t = 0; t < it->typeCount; t++) {
+      char *base = span->components[t];
+      char *next = SpanComponent(it, t, second);
+      size_t size = it->types[t]->componentSize;
+      if (base && next == base + size) {
+        span->strides[t] = size;
+      } else if (next == base) {
+        span->strides[t] = 0;
+      } else {
+        strided = 0;
+      }
+    }
+
+    if (strided) {
+      count = 2;
+      while (start + count < it->count) {
+        uint32_t entityId = it->indexes[start + count];
+        if (!SpanEntityUsable(it, entityId)) {
+          break;
+        }
+
+        int follows = 1;
+        for (size_t t = 0; t < it->typeCount && follows; t++) {
+          char *base = span->components[t];
+          follows = SpanComponent(it, t, entityId) ==
+                    (base ? base + count * span->strides[t] : NULL);
+        }
+        if (!follows) {
+          break;
+        }
+        count++;
+      }
+    }
+  }
+
+  if (count == 1) {
+    for (size_t t = 0; t < it->typeCount; t++) {
+      span->strides[t] = span->components[t] ? it->types[t]->componentSize : 0;
+    }
+  }
+
+  span->count = count;
+  it->cursor = start + count;
+  return 1;
+}
+
+// Mask scanning
+// ---------------------------------------------------------------------------------------------------
+
+// Queries that aren't worth registering are answered by scanning the packed
+// enabledMasks array. The scan tests (mask & include) == include and
+// !(mask & exclude) for several entities per instruction and writes out the
+// indexes of the matches without branching on each one. The widest kernel the
+// CPU supports is picked the first time a scan runs
+
+typedef size_t (*MaskScanFn)(const BitMask *masks, size_t count,
+                             BitMask include, BitMask exclude, uint32_t *out);
+
+// out needs room for count entries plus MASK_SCAN_SLACK, the kernels write a
+// few entries past the last match
+#define MASK_SCAN_SLACK 8
+
+// Scan masks[start, count), writing absolute indexes
+size_t MaskScanRange(const BitMask *masks, size_t start, size_t count,
+                     BitMask include, BitMask exclude, uint32_t *out) {
+  size_t matches = 0;
+  for (size_t i = start; i < count; i++) {
+    out[matches] = i;
+    matches += (masks[i] & include) == include && !(masks[i] & exclude);
+  }
+  return matches;
+}
+
+size_t MaskScanScalar(const BitMask *masks, size_t count, BitMask include,
+                      BitMask exclude, uint32_t *out) {
+  return MaskScanRange(masks, 0, count, include, exclude, out);
+}
+
+#if defined(__x86_64__)
+
+// For each 4 bit match mask, the positions of its set bits
+const uint32_t maskScanCompress[16][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {1, 0, 0, 0}, {0, 1, 0, 0},
+    {2, 0, 0, 0}, {0, 2, 0, 0}, {1, 2, 0, 0}, {0, 1, 2, 0},
+    {3, 0, 0, 0}, {0, 3, 0, 0}, {1, 3, 0, 0}, {0, 1, 3, 0},
+    {2, 3, 0, 0}, {0, 2, 3, 0}, {1, 2, 3, 0}, {0, 1, 2, 3},
+};
+
+// 2 entities per instruction. SSE2 has no 64 bit compare so it is built from
+// the 32 bit one by requiring both halves to match
+size_t MaskScanSSE2(const BitMask *masks, size_t count, BitMask include,
+                    BitMask exclude, uint32_t *out) {
+  __m128i includeV = _mm_set1_epi64x((long long)include);
+  __m128i excludeV = _mm_set1_epi64x((long long)exclude);
+  __m128i zero = _mm_setzero_si128();
+
+  size_t matches = 0;
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i m = _mm_loadu_si128((const __m128i *)(masks + i));
+    __m128i hasAll = _mm_cmpeq_epi32(_mm_and_si128(m, includeV), includeV);
+    __m128i hasNone = _mm_cmpeq_epi32(_mm_and_si128(m, excludeV), zero);
+    __m128i ok = _mm_and_si128(hasAll, hasNone);
+    ok = _mm_and_si128(ok, _mm_shuffle_epi32(ok, _MM_SHUFFLE(2, 3, 0, 1)));
+    int bits = _mm_movemask_pd(_mm_castsi128_pd(ok));
+
+    out[matches] = i;
+    matches += bits & 1;
+    out[matches] = i + 1;
+    matches += bits >> 1;
+  }
+
+  return matches +
+         MaskScanRange(masks, i, count, include, exclude, out + matches);
+}
+
+// 4 entities per instruction, two vectors per loop. The 4 bit match mask of
+// each vector picks a row of maskScanCompress which is added to the base index
+// and stored whole, only the first popcount entries of it are kept
+__attribute__((target("avx2,popcnt"))) size_t
+MaskScanAVX2(const BitMask *masks, size_t count, BitMask include,
+             BitMask exclude, uint32_t *out) {
+  __m256i includeV = _mm256_set1_epi64x((long long)include);
+  __m256i excludeV = _mm256_set1_epi64x((long long)exclude);
+  __m256i zero = _mm256_setzero_si256();
+
+  size_t matches = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(masks + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(masks + i + 4));
+
+    __m256i okA = _mm256_and_si256(
+        _mm256_cmpeq_epi64(_mm256_and_si256(a, includeV), includeV),
+        _mm256_cmpeq_epi64(_mm256_and_si256(a, excludeV), zero));
+    __m256i okB = _mm256_and_si256(
+        _mm256_cmpeq_epi64(_mm256_and_si256(b, includeV), includeV),
+        _mm256_cmpeq_epi64(_mm256_and_si256(b, excludeV), zero));
+
+    int bitsA = _mm256_movemask_pd(_mm256_castsi256_pd(okA));
+    int bitsB = _mm256_movemask_pd(_mm256_castsi256_pd(okB));
+
+    __m128i rowA = _mm_loadu_si128((const __m128i *)maskScanCompress[bitsA]);
+    _mm_storeu_si128((__m128i *)(out + matches),
+                     _mm_add_epi32(rowA, _mm_set1_epi32((int)i)));
+    matches += __builtin_popcount(bitsA);
+
+    __m128i rowB = _mm_loadu_si128((const __m128i *)maskScanCompress[bitsB]);
+    _mm_storeu_si128((__m128i *)(out + matches),
+                     _mm_add_epi32(rowB, _mm_set1_epi32((int)(i + 4))));
+    matches += __builtin_popcount(bitsB);
+  }
+
+  return matches +
+         MaskScanRange(masks, i, count, include, exclude, out + matches);
+}
+
+#endif
+
+MaskScanFn maskScanImpl = NULL;
+
+MaskScanFn MaskScanSelect() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    return MaskScanAVX2;
+  }
+  // every x86_64 CPU has SSE2
+  return MaskScanSSE2;
+#else
+  return MaskScanScalar;
+#endif
+}
+
+// Write the index of every mask in masks[0, count) that has all of include and
+// none of exclude to out (which needs count + MASK_SCAN_SLACK entries).
+// Returns the number of matches
+size_t MaskScan(const BitMask *masks, size_t count, BitMask include,
+                BitMask exclude, uint32_t *out) {
+  MaskScanFn scan = __atomic_load_n(&maskScanImpl, __ATOMIC_RELAXED);
+  if (!scan) {
+    scan = MaskScanSelect();
+    __atomic_store_n(&maskScanImpl, scan, __ATOMIC_RELAXED);
+  }
+  return scan(masks, count, include, exclude, out);
+}
+
+// Answer a query without registering it. Disabled components count as missing
+// for every term, as they do for registered queries. `out` needs room for entityListEnd +
+// MASK_SCAN_SLACK indexes. Returns the number of matches, terms without an
+// include or any component match nothing
+size_t BucketScanQuery(Bucket *bucket, QueryTerms terms, uint32_t *out) {
+  if (!terms.include && !terms.any) {
+    return 0;
+  }
+
+  size_t count = MaskScan(bucket->enabledMasks, bucket->entityListEnd,
+                          terms.include, terms.exclude, out);
+
+  if (!terms.any) {
+    return count;
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    out[kept] = out[i];
+    kept += (bucket->enabledMasks[out[i]] & terms.any) != 0;
+  }
+  return kept;
+}
+
+// Bitset queries
+// ---------------------------------------------------------------------------------------------------
+
+// Each component type keeps a hierarchical presence bitset, so a query can be
+// answered with AND/ANDNOT over 64 bit words. Only the included components'
+// summaries are looked at so whole 4096 entity regions that are missing any
+// included component are skipped without being touched. This is the best
+// option for sparse components in big buckets, MaskScan wins when most
+// entities match
+
+// Write the index of every entity with all of `include` and none of `exclude`
+// enabled (and at least one of `any` if it's non zero) to out, which needs
+// room for entityListEnd entries. `include` must not be empty. Returns the
+// number of matches
+size_t BucketBitsetQuery(Bucket *bucket, QueryTerms terms, uint32_t *out) {
+  HiBitSet *include[MAX_COMPONENT_TYPES];
+  HiBitSet *exclude[MAX_COMPONENT_TYPES];
+  HiBitSet *any[MAX_COMPONENT_TYPES];
+  size_t includeCount = 0;
+  size_t excludeCount = 0;
+  size_t anyCount = 0;
+
+  for (size_t i = 0; i < bucket->componentIdTop; i++) {
+    ComponentType *componentType = bucket->components[i];
+    if (terms.include & componentType->mask) {
+      include[includeCount++] = &componentType->presence;
+    }
+    if (terms.exclude & componentType->mask) {
+      exclude[excludeCount++] = &componentType->presence;
+    }
+    if (terms.any & componentType->mask) {
+      any[anyCount++] = &componentType->presence;
+    }
+  }
+
+  if (includeCount == 0) {
+    return 0;
+  }
+
+  size_t count = 0;
+  HiBitSet *first = include[0];
+
+  for (size_t a = 0; a < first->level2Words; a++) {
+    uint64_t bits2 = first->level2[a];
+    for (size_t k = 1; k < includeCount; k++) {
+      bits2 &= include[k]->level2[a];
+    }
+
+    for (; bits2; bits2 &= bits2 - 1) {
+      size_t j = a * 64 + __builtin_ctzll(bits2);
+      uint64_t bits1 = first->level1[j];
+      for (size_t k = 1; k < includeCount; k++) {
+        bits1 &= include[k]->level1[j];
+      }
+
+      for (; bits1; bits1 &= bits1 - 1) {
+        size_t w = j * 64 + __builtin_ctzll(bits1);
+        uint64_t bits0 = first->level0[w];
+        for (size_t k = 1; k < includeCount; k++) {
+          bits0 &= include[k]->level0[w];
+        }
+        for (size_t k = 0; k < excludeCount; k++) {
+          bits0 &= ~exclude[k]->level0[w];
+        }
+        if (anyCount) {
+          uint64_t anyBits = 0;
+          for (size_t k = 0; k < anyCount; k++) {
+            anyBits |= any[k]->level0[w];
+          }
+          bits0 &= anyBits;
+        }
+
+        for (; bits0; bits0 &= bits0 - 1) {
+          out[count++] = w * 64 + __builtin_ctzll(bits0);
+        }
+      }
+    }
+  }
+
+  return count;
+}
+
+// Sorted queries
+// ---------------------------------------------------------------------------------------------------
+
+// Queries can be put into a sorted order so that things like rendering can
+// batch by material or draw in order. Matches are rearranged in place so
+// QueryGetEntity and span iteration follow the sorted order, and runs of equal
+// keys are exposed as groups so each can be handled with a single batch call.
+//
+// The order is cached. Calling the sort again only re-sorts if entities have
+// joined or left the query or a component of the key type has been added or
+// fetched for writing since the last sort, even within the same tick.
+// Otherwise it just hands back the groups
+
+typedef struct QueryGroup {
+  uint32_t key;
+  size_t start; // Position in the query's matches of the first entity
+  size_t count;
+} QueryGroup;
+
+// Extract an integer sort key from an entity's key component
+typedef uint32_t (*QuerySortKeyFn)(const void *component, void *userData);
+
+// Order two entities (by index), returning <0, 0 or >0 like qsort
+typedef int (*QueryCompareFn)(Bucket *bucket, uint32_t a, uint32_t b,
+                              void *userData);
+
+int QuerySortPrepare(Bucket *bucket, Query *query) {
+  if (query->groups) {
+    return 1;
+  }
+
+  query->groups =
+      ArenaAllocate(bucket->arena, sizeof(QueryGroup) * MAX_ENTITIES);
+  query->sortScratch =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * 4 * MAX_ENTITIES);
+  return query->groups && query->sortScratch;
+}
+
+// Whether the cached order can be reused
+int QuerySortIsCurrent(Bucket *bucket, Query *query, ComponentType *keyType,
+                       void *sortFn, void *userData) {
+  // without a key component there's no way to tell if the order went stale
+  if (!keyType || !query->sorted || query->sortedVersion != query->version ||
+      query->sortKeyType != keyType || query->sortFn != sortFn ||
+      query->sortUserData != userData) {
+    return 0;
+  }
+
+  return query->sortedKeyVersion == ComponentTypeVersion(keyType);
+}
+
+void QuerySortFinish(Bucket *bucket, Query *query, ComponentType *keyType,
+                     void *sortFn, void *userData) {
+  for (size_t i = 0; i < query->count; i++) {
+    query->slots[query->matches[i]] = i + 1;
+  }
+
+  query->sorted = 1;
+  query->sortedVersion = query->version;
+  query->sortKeyType = keyType;
+  query->sortedKeyVersion = keyType ? ComponentTypeVersion(keyType) : 0;
+  query->sortFn = sortFn;
+  query->sortUserData = userData;
+}
+
+// Sort the query's matches by an integer key pulled out of `keyType` with an
+// LSD radix sort (stable, one pass per byte that actually varies). Returns the
+// number of groups of equal keys in query->groups
+size_t QuerySortByKey(Bucket *bucket, Query *query, ComponentType *keyType,
+                      QuerySortKeyFn keyFn, void *userData) {
+  if (!QuerySortPrepare(bucket, query)) {
+    return 0;
+  }
+
+  if (QuerySortIsCurrent(bucket, query, keyType, (void *)keyFn, userData)) {
+    return query->groupCount;
+  }
+
+  size_t n = query->count;
+  uint32_t *keys = query->sortScratch;
+  uint32_t *indexes = keys + MAX_ENTITIES;
+  uint32_t *keysOut = indexes + MAX_ENTITIES;
+  uint32_t *indexesOut = keysOut + MAX_ENTITIES;
+
+  for (size_t i = 0; i < n; i++) {
+    uint32_t entityId = query->matches[i];
+    indexes[i] = entityId;
+    keys[i] = keyFn(keyType->entries[entityId], userData);
+  }
+
+  for (int shift = 0; shift < 32; shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; i++) {
+      counts[(keys[i] >> shift) & 0xff]++;
+    }
+
+    // every key has the same byte here, the pass wouldn't change anything
+    if (n == 0 || counts[(keys[0] >> shift) & 0xff] == n) {
+      continue;
+    }
+
+    size_t offset = 0;
+    for (size_t b = 0; b < 256; b++) {
+      size_t count = counts[b];
+      counts[b] = offset;
+      offset += count;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      size_t to = counts[(keys[i] >> shift) & 0xff]++;
+      keysOut[to] = keys[i];
+      indexesOut[to] = indexes[i];
+    }
+
+    uint32_t *swap = keys;
+    keys = keysOut;
+    keysOut = swap;
+    swap = indexes;
+    indexes = indexesOut;
+    indexesOut = swap;
+  }
+
+  query->groupCount = 0;
+  for (size_t i = 0; i < n; i++) {
+    query->matches[i] = indexes[i];
+    if (i == 0 || keys[i] != keys[i - 1]) {
+      query->groups[query->groupCount++] =
+          (QueryGroup){.key = keys[i], .start = i, .count = 0};
+    }
+    query->groups[query->groupCount - 1].count++;
+  }
+
+  QuerySortFinish(bucket, query, keyType, (void *)keyFn, userData);
+  return query->groupCount;
+}
+
+// Sort the query's matches with a comparator (a stable merge sort). Entities
+// comparing equal form the groups, whose keys are just their group number.
+// `watchType` is the component the comparator looks at, if it's given the
+// order is cached like QuerySortByKey, otherwise every call re-sorts
+size_t QuerySortBy(Bucket *bucket, Query *query, QueryCompareFn compare,
+                   void *userData, ComponentType *watchType) {
+  if (!QuerySortPrepare(bucket, query)) {
+    return 0;
+  }
+
+  if (QuerySortIsCurrent(bucket, query, watchType, (void *)compare,
+                         userData)) {
+    return query->groupCount;
+  }
+
+  size_t n = query->count;
+  uint32_t *from = query->matches;
+  uint32_t *to = query->sortScratch;
+
+  for (size_t width = 1; width < n; width *= 2) {
+    for (size_t left = 0; left < n; left += 2 * width) {
+      size_t middle = left + width < n ? left + width : n;
+      size_t right = left + 2 * width < n ? left + 2 * width : n;
+      size_t i = left;
+      size_t j = middle;
+      size_t k = left;
+      while (i < middle && j < right) {
+        to[k++] = compare(bucket, from[j], from[i], userData) < 0 ? from[j++]
+                                                                  : from[i++];
+      }
+      while (i < middle) {
+        to[k++] = from[i++];
+      }
+      while (j < right) {
+        to[k++] = from[j++];
+      }
+    }
+    uint32_t *swap = from;
+    from = to;
+    to = swap;
+  }
+
+  if (from != query->matches) {
+    memcpy(query->matches, from, sizeof(uint32_t) * n);
+  }
+
+  query->groupCount = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0 ||
+        compare(bucket, query->matches[i - 1], query->matches[i], userData)) {
+      query->groups[query->groupCount] = (QueryGroup){
+          .key = query->groupCount, .start = i, .count = 0};
+      query->groupCount++;
+    }
+    query->groups[query->groupCount - 1].count++;
+  }
+
+  QuerySortFinish(bucket, query, watchType, (void *)compare, userData);
+  return query->groupCount;
+}
+
+// Spatial grid
+// ---------------------------------------------------------------------------------------------------
+
+// A uniform grid that buckets entities by the cell their position falls in, so
+// neighbourhood and collision checks only look at nearby entities instead of
+// comparing every pair. Cells live in an open addressing hash table so the
+// world doesn't need bounds, and each cell is an intrusive linked list through
+// per entity next/prev arrays so moving between cells never allocates.
+//
+// SpatialGridUpdate only looks at entities whose position component has been
+// added or changed since the last update, so positions need to be written
+// through the mutable getters (or the entity re-synced with
+// SpatialGridUpdateEntity). Entities that lose the position component are
+// dropped the next time a query runs into them
+
+#define SPATIAL_GRID_NONE UINT32_MAX
+
+typedef struct {
+  Bucket *bucket;
+  Query *query; // Every entity with the position component
+  ComponentType *positionType;
+  size_t xOffset; // Offsets of the x and y floats inside the component
+  size_t yOffset;
+  float cellSize;
+
+  uint64_t *cellKeys;  // Packed cell coordinates of each table slot
+  uint32_t *cellHeads; // First entity in each slot's cell
+  uint8_t *cellUsed;
+  size_t cellCapacity; // Power of two
+  size_t cellCount;
+
+  uint32_t *next;         // Next entity in the same cell
+  uint32_t *prev;         // Previous entity in the same cell
+  uint32_t *entityCells;  // Table slot of the cell each entity is in
+  uint32_t lastUpdateTick;
+} SpatialGrid;
+
+// Cell coordinates saturate at this so far away (or infinite) positions share
+// the outermost cells and box sizes can't overflow. NaN positions go in cell 0
+#define SPATIAL_GRID_MAX_COORD (1 << 30)
+
+int32_t SpatialGridCoord(SpatialGrid *grid, float value) {
+  float scaled = value / grid->cellSize;
+  if (scaled != scaled) {
+    return 0;
+  }
+  if (scaled < -SPATIAL_GRID_MAX_COORD) {
+    return -SPATIAL_GRID_MAX_COORD;
+  }
+  if (scaled > SPATIAL_GRID_MAX_COORD) {
+    return SPATIAL_GRID_MAX_COORD;
+  }
+  int32_t coord = (int32_t)scaled;
+  // round towards negative infinity rather than zero
+  return coord - ((float)coord > scaled);
+}
+
+uint64_t SpatialGridKey(int32_t x, int32_t y) {
+  return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+}
+
+// Find the table slot for a cell, creating it if `create` is set. Returns
+// SPATIAL_GRID_NONE if it doesn't exist
+uint32_t SpatialGridCellSlot(SpatialGrid *grid, uint64_t key, int create) {
+  size_t mask = grid->cellCapacity - 1;
+  size_t slot = (key * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+
+  for (;; slot = (slot + 1) & mask) {
+    if (!grid->cellUsed[slot]) {
+      if (!create) {
+        return SPATIAL_GRID_NONE;
+      }
+      grid->cellUsed[slot] = 1;
+      grid->cellKeys[slot] = key;
+      grid->cellHeads[slot] = SPATIAL_GRID_NONE;
+      grid->cellCount++;
+      return slot;
+    }
+    if (grid->cellKeys[slot] == key) {
+      return slot;
+    }
+  }
+}
+
+void SpatialGridUnlink(SpatialGrid *grid, uint32_t entityId) {
+  uint32_t cell = grid->entityCells[entityId];
+  if (cell == SPATIAL_GRID_NONE) {
+    return;
+  }
+
+  uint32_t next = grid->next[entityId];
+  uint32_t prev = grid->prev[entityId];
+  if (prev != SPATIAL_GRID_NONE) {
+    grid->next[prev] = next;
+  } else {
+    grid->cellHeads[cell] = next;
+  }
+  if (next != SPATIAL_GRID_NONE) {
+    grid->prev[next] = prev;
+  }
+
+  grid->entityCells[entityId] = SPATIAL_GRID_NONE;
+}
+
+void SpatialGridLink(SpatialGrid *grid, uint32_t entityId, uint32_t cell) {
+  uint32_t head = grid->cellHeads[cell];
+  grid->next[entityId] = head;
+  grid->prev[entityId] = SPATIAL_GRID_NONE;
+  if (head != SPATIAL_GRID_NONE) {
+    grid->prev[head] = entityId;
+  }
+  grid->cellHeads[cell] = entityId;
+  grid->entityCells[entityId] = cell;
+}
+
+void SpatialGridPosition(SpatialGrid *grid, uint32_t entityId, float *x,
+                         float *y) {
+  char *component = grid->positionType->entries[entityId];
+  *x = *(float *)(component + grid->xOffset);
+  *y = *(float *)(component + grid->yOffset);
+}
+
+void SpatialGridRebuild(SpatialGrid *grid);
+
+// Re-sync one entity with its current position (or drop it if it no longer
+// has one)
+void SpatialGridUpdateEntity(SpatialGrid *grid, uint32_t entityId) {
+  Entity *entity = grid->bucket->entities[entityId];
+  if (!(EntityEnabledMask(entity) & grid->positionType->mask)) {
+    SpatialGridUnlink(grid, entityId);
+    return;
+  }
+
+  float x, y;
+  SpatialGridPosition(grid, entityId, &x, &y);
+  uint64_t key =
+      SpatialGridKey(SpatialGridCoord(grid, x), SpatialGridCoord(grid, y));
+
+  uint32_t current = grid->entityCells[entityId];
+  if (current != SPATIAL_GRID_NONE && grid->cellKeys[current] == key) {
+    return;
+  }
+
+  // empty cells are never removed from the table, start over once it's
+  // getting full so probe sequences stay short
+  if (grid->cellCount * 10 >= grid->cellCapacity * 7) {
+    SpatialGridRebuild(grid);
+    return;
+  }
+
+  SpatialGridUnlink(grid, entityId);
+  SpatialGridLink(grid, entityId, SpatialGridCellSlot(grid, key, 1));
+}
+
+// Throw away every cell and re-insert every entity from scratch
+void SpatialGridRebuild(SpatialGrid *grid) {
+  memset(grid->cellUsed, 0, grid->cellCapacity);
+  grid->cellCount = 0;
+
+  for (size_t i = 0; i < MAX_ENTITIES; i++) {
+    grid->entityCells[i] = SPATIAL_GRID_NONE;
+  }
+
+  for (size_t i = 0; i < grid->query->count; i++) {
+    SpatialGridUpdateEntity(grid, grid->query->matches[i]);
+  }
+  grid->lastUpdateTick = grid->bucket->tick;
+}
+
+SpatialGrid *SpatialGridCreate(Bucket *bucket, ComponentType *positionType,
+                               size_t xOffset, size_t yOffset,
+                               float cellSize) {
+  if (!positionType || cellSize <= 0) {
+    return NULL;
+  }
+
+  size_t pos = bucket->arena->top;
+
+  size_t cellCapacity = 1;
+  while (cellCapacity < 2 * MAX_ENTITIES) {
+    cellCapacity *= 2;
+  }
+
+  SpatialGrid *grid = ArenaAllocate(bucket->arena, sizeof(SpatialGrid));
+  Query *query = BucketRegisterQuery(bucket, positionType->mask);
+  if (!grid || !query) {
+    bucket->arena->top = pos;
+    return NULL;
+  }
+
+  grid->bucket = bucket;
+  grid->query = query;
+  grid->positionType = positionType;
+  grid->xOffset = xOffset;
+  grid->yOffset = yOffset;
+  grid->cellSize = cellSize;
+  grid->cellCapacity = cellCapacity;
+  grid->cellKeys = ArenaAllocate(bucket->arena, sizeof(uint64_t) * cellCapacity);
+  grid->cellHeads =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * cellCapacity);
+  grid->cellUsed = ArenaAllocate(bucket->arena, cellCapacity);
+  grid->next = ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+  grid->prev = ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+  grid->entityCells =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * MAX_ENTITIES);
+
+  if (!grid->cellKeys || !grid->cellHeads || !grid->cellUsed || !grid->next ||
+      !grid->prev || !grid->entityCells) {
+    // the query has already been linked into the bucket so it stays, it's
+    // just never used
+    return NULL;
+  }
+
+  SpatialGridRebuild(grid);
+  return grid;
+}
+
+// Pick up everything that moved, appeared or was enabled since the last
+// update. It only touches the positions of entities whose component was
+// stamped as changed
+void SpatialGridUpdate(SpatialGrid *grid) {
+  ComponentType *positionType = grid->positionType;
+
+  for (size_t i = 0; i < grid->query->count; i++) {
+    uint32_t entityId = grid->query->matches[i];
+    // anything stamped on the tick of the last update may have come after it
+    if (grid->entityCells[entityId] == SPATIAL_GRID_NONE ||
+        !TickIsNewer(grid->lastUpdateTick,
+                     positionType->changedTicks[entityId])) {
+      SpatialGridUpdateEntity(grid, entityId);
+    }
+  }
+
+  grid->lastUpdateTick = grid->bucket->tick;
+}
+
+// Collect the entities in one cell that are inside the box, dropping any that
+// lost their position along the way
+size_t SpatialGridCollectCell(SpatialGrid *grid, uint32_t cell, float minX,
+                              float minY, float maxX, float maxY, float radius,
+                              float centreX, float centreY, uint32_t *out,
+                              size_t count, size_t maxCount) {
+  uint32_t entityId = grid->cellHeads[cell];
+  while (entityId != SPATIAL_GRID_NONE && count < maxCount) {
+    uint32_t next = grid->next[entityId];
+
+    Entity *entity = grid->bucket->entities[entityId];
+    if (!(EntityEnabledMask(entity) & grid->positionType->mask)) {
+      SpatialGridUnlink(grid, entityId);
+      entityId = next;
+      continue;
+    }
+
+    float x, y;
+    SpatialGridPosition(grid, entityId, &x, &y);
+    int inside = x >= minX && x <= maxX && y >= minY && y <= maxY;
+    if (inside && radius >= 0) {
+      float dx = x - centreX;
+      float dy = y - centreY;
+      inside = dx * dx + dy * dy <= radius * radius;
+    }
+    if (inside) {
+      out[count++] = entityId;
+    }
+
+    entityId = next;
+  }
+  return count;
+}
+
+size_t SpatialGridQueryBox(SpatialGrid *grid, float minX, float minY,
+                           float maxX, float maxY, float radius, float centreX,
+                           float centreY, uint32_t *out, size_t maxCount) {
+  int32_t fromX = SpatialGridCoord(grid, minX);
+  int32_t fromY = SpatialGridCoord(grid, minY);
+  int32_t toX = SpatialGridCoord(grid, maxX);
+  int32_t toY = SpatialGridCoord(grid, maxY);
+  if (fromX > toX || fromY > toY) {
+    return 0;
+  }
+
+  size_t count = 0;
+
+  // a box spanning more cells than the table has slots is cheaper to answer
+  // by walking the table
+  uint64_t boxCells = (uint64_t)((int64_t)toX - fromX + 1) *
+                      (uint64_t)((int64_t)toY - fromY + 1);
+  if (boxCells > grid->cellCapacity) {
+    for (size_t cell = 0; cell < grid->cellCapacity; cell++) {
+      if (!grid->cellUsed[cell] ||
+          grid->cellHeads[cell] == SPATIAL_GRID_NONE) {
+        continue;
+      }
+      int32_t cx = (int32_t)(uint32_t)(grid->cellKeys[cell] >> 32);
+      int32_t cy = (int32_t)(uint32_t)grid->cellKeys[cell];
+      if (cx >= fromX && cx <= toX && cy >= fromY && cy <= toY) {
+        count = SpatialGridCollectCell(grid, cell, minX, minY, maxX, maxY,
+                                       radius, centreX, centreY, out, count,
+                                       maxCount);
+      }
+    }
+    return count;
+  }
+
+  for (int64_t cx = fromX; cx <= toX; cx++) {
+    for (int64_t cy = fromY; cy <= toY; cy++) {
+      uint32_t cell = SpatialGridCellSlot(
+          grid, SpatialGridKey((int32_t)cx, (int32_t)cy), 0);
+      if (cell == SPATIAL_GRID_NONE) {
+        continue;
+      }
+      count = SpatialGridCollectCell(grid, cell, minX, minY, maxX, maxY,
+                                     radius, centreX, centreY, out, count,
+                                     maxCount);
+    }
+  }
+  return count;
+}
+
+// Every entity in the cell containing (x, y). All the query functions write up
+// to maxCount entity indexes to out and return how many they wrote
+size_t SpatialGridQueryCell(SpatialGrid *grid, float x, float y, uint32_t *out,
+                            size_t maxCount) {
+  uint32_t cell = SpatialGridCellSlot(
+      grid,
+      SpatialGridKey(SpatialGridCoord(grid, x), SpatialGridCoord(grid, y)), 0);
+  if (cell == SPATIAL_GRID_NONE) {
+    return 0;
+  }
+  return SpatialGridCollectCell(grid, cell, -INFINITY, -INFINITY, INFINITY,
+                                INFINITY, -1, 0, 0, out, 0, maxCount);
+}
+
+// Every entity whose position is inside the box (edges included)
+size_t SpatialGridQueryAABB(SpatialGrid *grid, float minX, float minY,
+                            float maxX, float maxY, uint32_t *out,
+                            size_t maxCount) {
+  return SpatialGridQueryBox(grid, minX, minY, maxX, maxY, -1, 0, 0, out,
+                             maxCount);
+}
+
+// Every entity within radius of (x, y)
+size_t SpatialGridQueryRadius(SpatialGrid *grid, float x, float y,
+                              float radius, uint32_t *out, size_t maxCount) {
+  return SpatialGridQueryBox(grid, x - radius, y - radius, x + radius,
+                             y + radius, radius, x, y, out, maxCount);
+}
+
+// Relationships
+// ---------------------------------------------------------------------------------------------------
+
+// ChildOf style parent/child pairs. Each entity has at most one parent, and
+// every parent's children are kept contiguous in one shared array (sorted by
+// parent, then entity index) so walking a parent's children is a linear read.
+// The packed layout and the traversal order are rebuilt lazily the first time
+// they're asked for after a relationship changes. Deleting an entity detaches
+// it from its parent and leaves its children as roots
+
+#define NO_PARENT UINT32_MAX
+
+typedef enum {
+  HIERARCHY_BREADTH_FIRST, // Every root, then every depth 1 entity, ...
+  HIERARCHY_DEPTH_FIRST,   // Each subtree contiguous, parents before children
+} HierarchyTraversal;
+
+typedef struct EntityHierarchy {
+  uint32_t *parents;
+  uint32_t *childCounts;
+  uint32_t *childStarts; // Offset of each entity's children in children
+  uint32_t *children;
+  size_t relationCount; // Number of entities with a parent
+  int dirty;            // children needs rebuilding
+
+  uint32_t *order; // Every entity in a hierarchy, parents before children
+  uint32_t *depths; // Depth of each entry in order, roots are 0
+  uint32_t *stack;
+  size_t orderCount;
+  HierarchyTraversal orderTraversal;
+  int orderDirty;
+} EntityHierarchy;
+
+EntityHierarchy *BucketHierarchy(Bucket *bucket) {
+  if (bucket->hierarchy) {
+    return bucket->hierarchy;
+  }
+
+  size_t pos = bucket->arena->top;
+  size_t arraySize = sizeof(uint32_t) * MAX_ENTITIES;
+
+  EntityHierarchy *hierarchy =
+      ArenaAllocate(bucket->arena, sizeof(EntityHierarchy));
+  if (!hierarchy) {
+    return NULL;
+  }
+  hierarchy->parents = ArenaAllocate(bucket->arena, arraySize);
+  hierarchy->childCounts = ArenaAllocate(bucket->arena, arraySize);
+  hierarchy->childStarts =
+      ArenaAllocate(bucket->arena, sizeof(uint32_t) * (MAX_ENTITIES + 1));
+  hierarchy->children = ArenaAllocate(bucket->arena, arraySize);
+  hierarchy->order = ArenaAllocate(bucket->arena, arraySize);
+  hierarchy->depths = ArenaAllocate(bucket->arena, arraySize);
+  hierarchy->stack = ArenaAllocate(bucket->arena, arraySize * 2);
+
+  if (!hierarchy->parents || !hierarchy->childCounts ||
+      !hierarchy->childStarts || !hierarchy->children || !hierarchy->order ||
+      !hierarchy->depths || !hierarchy->stack) {
+    bucket->arena->top = pos;
+    return NULL;
+  }
+
+  for (size_t i = 0; i < MAX_ENTITIES; i++) {
+    hierarchy->parents[i] = NO_PARENT;
+  }
+  hierarchy->dirty = 1;
+  hierarchy->orderDirty = 1;
+
+  bucket->hierarchy = hierarchy;
+  return hierarchy;
+}
+
+// Make parent the parent of child, or detach child if parent is NULL. Returns
+// 0 if it would create a cycle
+int BucketSetParent(Bucket *bucket, Entity *child, Entity *parent) {
+  EntityHierarchy *hierarchy = BucketHierarchy(bucket);
+  if (!hierarchy || !child) {
+    return 0;
+  }
+
+  uint32_t childId = child->index;
+  uint32_t parentId = parent ? parent->index : NO_PARENT;
+
+  for (uint32_t ancestor = parentId; ancestor != NO_PARENT;
+       ancestor = hierarchy->parents[ancestor]) {
+    if (ancestor == childId) {
+      return 0;
+    }
+  }
+
+  uint32_t oldParentId = hierarchy->parents[childId];
+  if (oldParentId == parentId) {
+    return 1;
+  }
+
+  if (oldParentId != NO_PARENT) {
+    hierarchy->childCounts[oldParentId]--;
+    hierarchy->relationCount--;
+  }
+  if (parentId != NO_PARENT) {
+    hierarchy->childCounts[parentId]++;
+    hierarchy->relationCount++;
+  }
+
+  hierarchy->parents[childId] = parentId;
+  hierarchy->dirty = 1;
+  hierarchy->orderDirty = 1;
+  return 1;
+}
+
+Entity *BucketGetParent(Bucket *bucket, Entity *child) {
+  if (!bucket->hierarchy || !child) {
+    return NULL;
+  }
+
+  uint32_t parentId = bucket->hierarchy->parents[child->index];
+  return parentId == NO_PARENT ? NULL : bucket->entities[parentId];
+}
+
+void BucketDetachEntity(Bucket *bucket, uint32_t entityId) {
+  EntityHierarchy *hierarchy = bucket->hierarchy;
+  Entity *entity = bucket->entities[entityId];
+
+  BucketSetParent(bucket, entity, NULL);
+  if (!hierarchy->childCounts[entityId]) {
+    return;
+  }
+
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    if (hierarchy->parents[i] == entityId) {
+      BucketSetParent(bucket, bucket->entities[i], NULL);
+    }
+  }
+}
+
+// Counting sort every relationship by parent so each parent's children end up
+// next to each other
+void HierarchyRebuildChildren(Bucket *bucket, EntityHierarchy *hierarchy) {
+  uint32_t offset = 0;
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    hierarchy->childStarts[i] = offset;
+    offset += hierarchy->childCounts[i];
+  }
+
+  // childStarts doubles as the write cursor, leaving each entry pointing at
+  // the start of the next parent's children once everything is placed
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    uint32_t parentId = hierarchy->parents[i];
+    if (parentId != NO_PARENT) {
+      hierarchy->children[hierarchy->childStarts[parentId]++] = i;
+    }
+  }
+  for (size_t i = bucket->entityListEnd; i > 0; i--) {
+    hierarchy->childStarts[i] = hierarchy->childStarts[i - 1];
+  }
+  hierarchy->childStarts[0] = 0;
+
+  hierarchy->dirty = 0;
+}
+
+// The children of parent as entity indexes. The pointer stays valid until a
+// relationship changes
+const uint32_t *BucketGetChildren(Bucket *bucket, Entity *parent,
+                                  size_t *count) {
+  EntityHierarchy *hierarchy = bucket->hierarchy;
+  *count = 0;
+  if (!hierarchy || !parent) {
+    return NULL;
+  }
+
+  if (hierarchy->dirty) {
+    HierarchyRebuildChildren(bucket, hierarchy);
+  }
+
+  *count = hierarchy->childCounts[parent->index];
+  return &hierarchy->children[hierarchy->childStarts[parent->index]];
+}
+
+// Every entity that has a parent or children, ordered so a parent always comes
+// before its children. Propagating something down the hierarchy (transforms,
+// snake segments following each other) is then one pass over the array with
+// depths available for free. The result stays valid until a relationship
+// changes
+const uint32_t *BucketHierarchyOrder(Bucket *bucket,
+                                     HierarchyTraversal traversal,
+                                     size_t *count) {
+  EntityHierarchy *hierarchy = bucket->hierarchy;
+  *count = 0;
+  if (!hierarchy) {
+    return NULL;
+  }
+
+  if (hierarchy->dirty) {
+    HierarchyRebuildChildren(bucket, hierarchy);
+  }
+  if (!hierarchy->orderDirty && hierarchy->orderTraversal == traversal) {
+    *count = hierarchy->orderCount;
+    return hierarchy->order;
+  }
+
+  size_t orderCount = 0;
+
+  if (traversal == HIERARCHY_BREADTH_FIRST) {
+    // seeding the queue with every root keeps the whole order sorted by depth
+    for (size_t i = 0; i < bucket->entityListEnd; i++) {
+      if (hierarchy->parents[i] == NO_PARENT && hierarchy->childCounts[i]) {
+        hierarchy->depths[orderCount] = 0;
+        hierarchy->order[orderCount++] = i;
+      }
+    }
+
+    for (size_t head = 0; head < orderCount; head++) {
+      uint32_t entityId = hierarchy->order[head];
+      uint32_t start = hierarchy->childStarts[entityId];
+      uint32_t end = start + hierarchy->childCounts[entityId];
+      for (uint32_t c = start; c < end; c++) {
+        hierarchy->depths[orderCount] = hierarchy->depths[head] + 1;
+        hierarchy->order[orderCount++] = hierarchy->children[c];
+      }
+    }
+  } else {
+    for (size_t i = 0; i < bucket->entityListEnd; i++) {
+      if (hierarchy->parents[i] != NO_PARENT || !hierarchy->childCounts[i]) {
+        continue;
+      }
+
+      // the stack holds (entity, depth) pairs
+      size_t stackTop = 0;
+      hierarchy->stack[stackTop++] = i;
+      hierarchy->stack[stackTop++] = 0;
+      while (stackTop) {
+        uint32_t depth = hierarchy->stack[--stackTop];
+        uint32_t entityId = hierarchy->stack[--stackTop];
+        hierarchy->depths[orderCount] = depth;
+        hierarchy->order[orderCount++] = entityId;
+
+        // push in reverse so children come out in index order
+        uint32_t start = hierarchy->childStarts[entityId];
+        uint32_t end = start + hierarchy->childCounts[entityId];
+        for (uint32_t c = end; c > start; c--) {
+          hierarchy->stack[stackTop++] = hierarchy->children[c - 1];
+          hierarchy->stack[stackTop++] = depth + 1;
+        }
+      }
+    }
+  }
+
+  hierarchy->orderCount = orderCount;
+  hierarchy->orderTraversal = traversal;
+  hierarchy->orderDirty = 0;
+
+  *count = orderCount;
+  return hierarchy->order;
+}
+
+// Job system
+// ---------------------------------------------------------------------------------------------------
+
+// A small work-stealing job system shared by everything in ecc that wants more
+// than one core. Every worker owns a Chase-Lev deque: it pushes and pops jobs
+// at the bottom while idle workers steal from the top, so the owner and
+// thieves only contend when one job is left. The thread that creates the
+// system is worker 0, it has a deque too and helps run jobs while it waits on
+// a counter. Idle workers spin for a while before going to sleep, which keeps
+// wake up latency low for work arriving every frame at 60-240Hz without
+// burning cores between frames
+//
+// Jobs and counters belong to whoever submits them and have to stay alive
+// until the counter has been waited on. Only worker 0 and jobs running on the
+// system may submit to it
+
+#ifndef MAX_WORKER_THREADS
+#define MAX_WORKER_THREADS 64
+#endif
+
+#ifndef JOB_DEQUE_SIZE
+#define JOB_DEQUE_SIZE 1024 // Must be a power of two
+#endif
+
+#ifndef JOB_SPIN_COUNT
+#define JOB_SPIN_COUNT 2048 // Failed attempts to find work before sleeping
+#endif
+
+typedef void (*JobFn)(void *data, int worker);
+
+// Counts jobs that haven't finished, see JobSystemWait
+typedef struct {
+  int64_t pending;
+} JobCounter;
+
+typedef struct {
+  JobFn fn;
+  void *data;
+  JobCounter *counter;
+} Job;
+
+typedef struct {
+  // top and bottom on their own cache lines so thieves and the owner don't
+  // false share
+  int64_t top __attribute__((aligned(64)));
+  int64_t bottom __attribute__((aligned(64)));
+  Job *jobs[JOB_DEQUE_SIZE] __attribute__((aligned(64)));
+} JobDeque;
+
+typedef struct JobSystem {
+  JobDeque deques[MAX_WORKER_THREADS];
+  pthread_t threads[MAX_WORKER_THREADS];
+  int threadCount; // Including worker 0
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int sleepers;
+  int stop;
+} JobSystem;
+
+typedef struct {
+  JobSystem *system;
+  int worker;
+  int cpu; // -1 to leave the thread unpinned
+} JobWorkerStart;
+
+// Which worker of which system the current thread is
+__thread JobSystem *eccJobSystem;
+__thread int eccJobWorker;
+
+int JobSystemCurrentWorker(JobSystem *system) {
+  return eccJobSystem == system ? eccJobWorker : 0;
+}
+
+// Back off after failing to find work `idle` times in a row. Short waits just
+// pause, longer ones give the core away in case the thread with the work
+// isn't scheduled (more workers than cores)
+void JobBackOff(int idle) {
+  if (idle < JOB_SPIN_COUNT / 2) {
+#if defined(__x86_64__)
+    _mm_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+// Owner only
+int JobDequePush(JobDeque *deque, Job *job) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= JOB_DEQUE_SIZE) {
+    return 0;
+  }
+
+  __atomic_store_n(&deque->jobs[bottom & (JOB_DEQUE_SIZE - 1)], job,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Owner only, takes the most recently pushed job
+Job *JobDequePop(JobDeque *deque) {
+  // the store to bottom has to be visible before top is read, which takes
+  // sequential consistency on both (the thieves do the same the other way)
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  Job *job = __atomic_load_n(&deque->jobs[bottom & (JOB_DEQUE_SIZE - 1)],
+                             __ATOMIC_RELAXED);
+  if (top == bottom) {
+    // last job, race any thieves for it
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      job = NULL;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return job;
+}
+
+// Any thread, takes the oldest job
+Job *JobDequeSteal(JobDeque *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+  if (top >= bottom) {
+    return NULL;
+  }
+
+  Job *job = __atomic_load_n(&deque->jobs[top & (JOB_DEQUE_SIZE - 1)],
+                             __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return job;
+}
+
+Job *JobSystemFindJob(JobSystem *system, int worker) {
+  Job *job = JobDequePop(&system->deques[worker]);
+  for (int i = 1; i < system->threadCount && !job; i++) {
+    job = JobDequeSteal(&system->deques[(worker + i) % system->threadCount]);
+  }
+  return job;
+}
+
+int JobSystemHasWork(JobSystem *system) {
+  for (int i = 0; i < system->threadCount; i++) {
+    JobDeque *deque = &system->deques[i];
+    if (__atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST) >
+        __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void JobRun(Job *job, int worker) {
+  JobCounter *counter = job->counter;
+  job->fn(job->data, worker);
+  if (counter) {
+    __atomic_sub_fetch(&counter->pending, 1, __ATOMIC_RELEASE);
+  }
+}
+
+void *JobWorkerMain(void *arg) {
+  JobWorkerStart *start = arg;
+  JobSystem *system = start->system;
+  int worker = start->worker;
+
+#if defined(__linux__) && defined(CPU_SET)
+  if (start->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(start->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+#endif
+  free(start);
+
+  eccJobSystem = system;
+  eccJobWorker = worker;
+
+  int idle = 0;
+  for (;;) {
+    Job *job = JobSystemFindJob(system, worker);
+    if (job) {
+      JobRun(job, worker);
+      idle = 0;
+      continue;
+    }
+
+    if (__atomic_load_n(&system->stop, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+
+    if (++idle < JOB_SPIN_COUNT) {
+      JobBackOff(idle);
+      continue;
+    }
+
+    // check again after announcing ourselves as a sleeper, submitters read
+    // sleepers after publishing their jobs so one of us sees the other. Both
+    // sides need a full fence, otherwise the store before it can be moved
+    // after the load that follows (even on x86)
+    pthread_mutex_lock(&system->lock);
+    __atomic_add_fetch(&system->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!system->stop && !JobSystemHasWork(system)) {
+      pthread_cond_wait(&system->wake, &system->lock);
+    }
+    __atomic_sub_fetch(&system->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&system->lock);
+    idle = 0;
+  }
+}
+
+void JobSystemDestroy(JobSystem *system) {
+  if (!system) {
+    return;
+  }
+
+  pthread_mutex_lock(&system->lock);
+  __atomic_store_n(&system->stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&system->wake);
+  pthread_mutex_unlock(&system->lock);
+
+  for (int i = 1; i < system->threadCount; i++) {
+    pthread_join(system->threads[i], NULL);
+  }
+
+  if (eccJobSystem == system) {
+    eccJobSystem = NULL;
+  }
+  pthread_mutex_destroy(&system->lock);
+  pthread_cond_destroy(&system->wake);
+  free(system);
+}
+
+// Create a job system with threadCount workers, counting the calling thread.
+// With pinThreads set worker i is pinned to CPU i (modulo the CPU count),
+// where the platform supports it
+JobSystem *JobSystemCreate(int threadCount, int pinThreads) {
+  if (threadCount < 1) {
+    threadCount = 1;
+  }
+  if (threadCount > MAX_WORKER_THREADS) {
+    threadCount = MAX_WORKER_THREADS;
+  }
+
+  size_t size = (sizeof(JobSystem) + 63) & ~(size_t)63;
+  JobSystem *system = aligned_alloc(64, size);
+  if (!system) {
+    return NULL;
+  }
+  memset(system, 0, size);
+  pthread_mutex_init(&system->lock, NULL);
+  pthread_cond_init(&system->wake, NULL);
+
+  eccJobSystem = system;
+  eccJobWorker = 0;
+
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  cpuCount = cpuCount > 0 ? cpuCount : 1;
+
+  // workers read threadCount as soon as they start so it's set up front, if a
+  // thread fails to start the ones that did are shut down again
+  system->threadCount = threadCount;
+  for (int i = 1; i < threadCount; i++) {
+    JobWorkerStart *start = malloc(sizeof(JobWorkerStart));
+    if (start) {
+      start->system = system;
+      start->worker = i;
+      start->cpu = pinThreads ? (int)(i % cpuCount) : -1;
+    }
+    if (!start ||
+        pthread_create(&system->threads[i], NULL, JobWorkerMain, start)) {
+      free(start);
+      system->threadCount = i;
+      JobSystemDestroy(system);
+      return NULL;
+    }
+  }
+
+  return system;
+}
+
+// Queue count jobs on the calling worker's deque, adding them to counter
+// (which may be NULL). If the deque is full the overflow runs right away
+void JobSystemSubmit(JobSystem *system, Job *jobs, size_t count,
+                     JobCounter *counter) {
+  int worker = JobSystemCurrentWorker(system);
+  if (counter) {
+    __atomic_add_fetch(&counter->pending, count, __ATOMIC_RELAXED);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    jobs[i].counter = counter;
+    if (!JobDequePush(&system->deques[worker], &jobs[i])) {
+      JobRun(&jobs[i], worker);
+    }
+  }
+
+  // pairs with the fence in JobWorkerMain, see there
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&system->sleepers, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&system->lock);
+    pthread_cond_broadcast(&system->wake);
+    pthread_mutex_unlock(&system->lock);
+  }
+}
+
+// Run jobs until every job added to counter has finished
+void JobSystemWait(JobSystem *system, JobCounter *counter) {
+  int worker = JobSystemCurrentWorker(system);
+  int idle = 0;
+  while (__atomic_load_n(&counter->pending, __ATOMIC_ACQUIRE) > 0) {
+    Job *job = JobSystemFindJob(system, worker);
+    if (job) {
+      JobRun(job, worker);
+      idle = 0;
+    } else {
+      // never sleeps, the last jobs finishing don't wake anyone
+      JobBackOff(idle < JOB_SPIN_COUNT ? ++idle : idle);
+    }
+  }
+}
+
+// Parallel iteration
+// ---------------------------------------------------------------------------------------------------
+
+// Splits a list of entity indexes into ranges and runs a callback over them on
+// a job system. Every worker starts with an even share packed into one 64 bit
+// word (begin << 32 | end) and takes grain sized pieces off the front of it. A
+// worker that runs out steals the back half of someone else's range (or all
+// of it once it's down to a grain), so uneven work still finishes at roughly
+// the same time on every core. Callbacks can start parallel loops of their own
+
+// Called with a piece of the index list. worker is in [0, threadCount) so it
+// can index per thread scratch
+typedef void (*ParallelForFn)(Bucket *bucket, const uint32_t *entityIndexes,
+                              size_t count, void *userData, int worker);
+
+typedef struct {
+  JobSystem *system;
+  Bucket *bucket;
+  const uint32_t *entityIndexes;
+  ParallelForFn fn;
+  void *userData;
+  uint32_t grain;
+  uint64_t ranges[MAX_WORKER_THREADS];
+} ParallelForContext;
+
+uint64_t ParallelRangePack(uint32_t begin, uint32_t end) {
+  return (uint64_t)begin << 32 | end;
+}
+
+// Take up to grain indexes off the front of a range
+int ParallelRangeTake(uint64_t *range, uint32_t grain, uint32_t *begin,
+                      uint32_t *end) {
+  uint64_t current = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t from = current >> 32;
+    uint32_t to = (uint32_t)current;
+    if (from >= to) {
+      return 0;
+    }
+
+    uint32_t split = to - from > grain ? from + grain : to;
+    if (__atomic_compare_exchange_n(range, &current,
+                                    ParallelRangePack(split, to), 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *begin = from;
+      *end = split;
+      return 1;
+    }
+  }
+}
+
+// Move the back half of victim into thief, which has to be empty. The owner
+// of a range may be busy with another job, so small ranges are taken whole
+// rather than waiting for it
+int ParallelRangeSteal(uint64_t *victim, uint64_t *thief, uint32_t grain) {
+  uint64_t current = __atomic_load_n(victim, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t from = current >> 32;
+    uint32_t to = (uint32_t)current;
+    if (from >= to) {
+      return 0;
+    }
+
+    uint32_t middle = to - from <= grain ? from : from + (to - from) / 2;
+    if (__atomic_compare_exchange_n(victim, &current,
+                                    ParallelRangePack(from, middle), 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(thief, ParallelRangePack(middle, to), __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+}
+
+void ParallelForWork(void *data, int worker) {
+  ParallelForContext *context = data;
+  int threadCount = context->system ? context->system->threadCount : 1;
+  uint64_t *own = &context->ranges[worker];
+
+  for (;;) {
+    uint32_t begin, end;
+    while (ParallelRangeTake(own, context->grain, &begin, &end)) {
+      context->fn(context->bucket, context->entityIndexes + begin, end - begin,
+                  context->userData, worker);
+    }
+
+    int stole = 0;
+    for (int i = 1; i < threadCount && !stole; i++) {
+      int victim = (worker + i) % threadCount;
+      stole = ParallelRangeSteal(&context->ranges[victim], own, context->grain);
+    }
+    if (!stole) {
+      return;
+    }
+  }
+}
+
+// Run fn over every index in entityIndexes, grain at a time, while the calling
+// thread runs mainFn (if set) before joining in. A grain of 0 picks one that
+// gives each thread around 8 pieces, which leaves room for stealing without
+// paying for it on every entity. Returns once everything has been processed
+void ParallelForIndexesWhile(JobSystem *system, Bucket *bucket,
+                             const uint32_t *entityIndexes, size_t count,
+                             size_t grain, ParallelForFn fn, void *userData,
+                             void (*mainFn)(void *mainData), void *mainData) {
+  int threadCount = system ? system->threadCount : 1;
+  if (!grain) {
+    grain = count / ((size_t)threadCount * 8);
+    grain = grain ? grain : 1;
+  }
+
+  if (threadCount == 1 || !count || (!mainFn && count <= grain)) {
+    if (mainFn) {
+      mainFn(mainData);
+    }
+    if (count) {
+      fn(bucket, entityIndexes, count, userData, 0);
+    }
+    return;
+  }
+
+  int worker = JobSystemCurrentWorker(system);
+
+  ParallelForContext context;
+  context.system = system;
+  context.bucket = bucket;
+  context.entityIndexes = entityIndexes;
+  context.fn = fn;
+  context.userData = userData;
+  context.grain = grain > UINT32_MAX ? UINT32_MAX : (uint32_t)grain;
+
+  // the calling thread starts empty handed when it has its own work, it
+  // steals whatever is left once that's done
+  int shares = mainFn ? threadCount - 1 : threadCount;
+  int share = 0;
+  for (int i = 0; i < threadCount; i++) {
+    if (mainFn && i == worker) {
+      context.ranges[i] = 0;
+      continue;
+    }
+    uint32_t begin = count * share / shares;
+    uint32_t end = count * (share + 1) / shares;
+    context.ranges[i] = ParallelRangePack(begin, end);
+    share++;
+  }
+
+  // one helper per other worker, whoever picks one up works through its own
+  // share and then steals
+  Job helpers[MAX_WORKER_THREADS];
+  for (int i = 0; i < threadCount - 1; i++) {
+    helpers[i].fn = ParallelForWork;
+    helpers[i].data = &context;
+  }
+  JobCounter counter = {0};
+  JobSystemSubmit(system, helpers, threadCount - 1, &counter);
+
+  if (mainFn) {
+    mainFn(mainData);
+  }
+  ParallelForWork(&context, worker);
+  JobSystemWait(system, &counter);
+}
+
+void ParallelForIndexes(JobSystem *system, Bucket *bucket,
+                        const uint32_t *entityIndexes, size_t count,
+                        size_t grain, ParallelForFn fn, void *userData) {
+  ParallelForIndexesWhile(system, bucket, entityIndexes, count, grain, fn,
+                          userData, NULL, NULL);
+}
+
+// Run fn over every entity matching a registered query. Matches whose
+// components are disabled or that have an excluded component are included,
+// check them with QueryGetEntity where that matters. The query must not
+// change until this returns
+void QueryParallelFor(JobSystem *system, Bucket *bucket, Query *query,
+                      size_t grain, ParallelForFn fn, void *userData) {
+  ParallelForIndexes(system, bucket, query->matches, query->count, grain, fn,
+                     userData);
+}
+
+// Profiling
+// ---------------------------------------------------------------------------------------------------
+
+// Opt in instrumentation for finding out which system eats the frame. Once
+// enabled with ProfilerEnable, frames, phases (waves when systems run in
+// parallel) and systems record how long they took and how many entities they
+// processed. Each thread writes into its own ring buffer, so recording never
+// takes a lock and only the owning thread moves the write position; once a
+// ring is full the oldest events are overwritten. When profiling is off the
+// cost is one load per instrumented scope.
+//
+// ProfilerWriteChromeTrace dumps everything still in the rings as Chrome trace
+// JSON, which chrome://tracing and Perfetto can open. Call it between frames.
+// Event names aren't copied so they have to outlive the dump (system names
+// are normally string literals)
+
+#ifndef PROFILE_RING_SIZE
+#define PROFILE_RING_SIZE 16384 // Events per thread, must be a power of two
+#endif
+
+#ifndef MAX_PROFILE_THREADS
+#define MAX_PROFILE_THREADS 128
+#endif
+
+typedef enum {
+  PROFILE_FRAME,
+  PROFILE_PHASE,
+  PROFILE_SYSTEM,
+} ProfileCategory;
+
+typedef struct {
+  const char *name;
+  uint64_t startNs;
+  uint64_t durationNs;
+  uint32_t entities;
+  uint32_t category;
+} ProfileEvent;
+
+typedef struct {
+  ProfileEvent events[PROFILE_RING_SIZE];
+  uint64_t head; // Events written so far, the newest is at head - 1
+  int threadId;
+} ProfileRing;
+
+typedef struct {
+  int enabled;
+  ProfileRing *rings[MAX_PROFILE_THREADS];
+  int ringCount;
+  uint64_t startNs; // Trace timestamps are relative to this
+} Profiler;
+
+Profiler eccProfiler;
+__thread ProfileRing *eccProfileRing;
+
+void ProfilerEnable(int enabled) {
+  if (enabled && !eccProfiler.startNs) {
+    eccProfiler.startNs = EccNowNs();
+  }
+  __atomic_store_n(&eccProfiler.enabled, enabled, __ATOMIC_RELEASE);
+}
+
+int ProfilerEnabled() {
+  return __atomic_load_n(&eccProfiler.enabled, __ATOMIC_RELAXED);
+}
+
+// Returns the start time to pass to ProfileEnd, or 0 when profiling is off
+uint64_t ProfileBegin() { return ProfilerEnabled() ? EccNowNs() : 0; }
+
+void ProfileEnd(const char *name, ProfileCategory category, uint64_t startNs,
+                size_t entities) {
+  if (!startNs) {
+    return;
+  }
+  uint64_t endNs = EccNowNs();
+
+  ProfileRing *ring = eccProfileRing;
+  if (!ring) {
+    int slot = __atomic_fetch_add(&eccProfiler.ringCount, 1, __ATOMIC_ACQ_REL);
+    if (slot >= MAX_PROFILE_THREADS) {
+      __atomic_fetch_sub(&eccProfiler.ringCount, 1, __ATOMIC_ACQ_REL);
+      return;
+    }
+    ring = calloc(1, sizeof(ProfileRing));
+    if (!ring) {
+      return;
+    }
+    ring->threadId = slot;
+    __atomic_store_n(&eccProfiler.rings[slot], ring, __ATOMIC_RELEASE);
+    eccProfileRing = ring;
+  }
+
+  uint64_t head = ring->head;
+  ProfileEvent *event = &ring->events[head & (PROFILE_RING_SIZE - 1)];
+  event->name = name;
+  event->startNs = startNs;
+  event->durationNs = endNs - startNs;
+  event->entities = entities > UINT32_MAX ? UINT32_MAX : (uint32_t)entities;
+  event->category = category;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Forget every recorded event. Nothing may be recording at the same time
+void ProfilerReset() {
+  int ringCount = __atomic_load_n(&eccProfiler.ringCount, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < ringCount && i < MAX_PROFILE_THREADS; i++) {
+    ProfileRing *ring = __atomic_load_n(&eccProfiler.rings[i], __ATOMIC_ACQUIRE);
+    if (ring) {
+      __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    }
+  }
+  eccProfiler.startNs = EccNowNs();
+}
+
+void ProfileWriteJsonString(FILE *file, const char *value) {
+  fputc('"', file);
+  for (const char *c = value ? value : "?"; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+      fputc(*c, file);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// Write every recorded event as complete ("X") events. Returns 0 if the file
+// couldn't be written
+int ProfilerWriteChromeTrace(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return 0;
+  }
+
+  static const char *categories[] = {"frame", "phase", "system"};
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  int first = 1;
+  int ringCount = __atomic_load_n(&eccProfiler.ringCount, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < ringCount && i < MAX_PROFILE_THREADS; i++) {
+    ProfileRing *ring = __atomic_load_n(&eccProfiler.rings[i], __ATOMIC_ACQUIRE);
+    if (!ring) {
+      continue;
+    }
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > PROFILE_RING_SIZE ? head - PROFILE_RING_SIZE : 0;
+    for (uint64_t e = start; e < head; e++) {
+      ProfileEvent *event = &ring->events[e & (PROFILE_RING_SIZE - 1)];
+      // events from before a reset are dropped
+      if (event->startNs < eccProfiler.startNs) {
+        continue;
+      }
+
+      fprintf(file, "%s\n{\"name\":", first ? "" : ",");
+      ProfileWriteJsonString(file, event->name);
+      fprintf(file,
+              ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"entities\":%u}}",
+              categories[event->category], ring->threadId,
+              (double)(event->startNs - eccProfiler.startNs) / 1000.0,
+              (double)event->durationNs / 1000.0, event->entities);
+      first = 0;
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  return fclose(file) == 0;
+}
+
+// Systems
+// ---------------------------------------------------------------------------------------------------
+
+// Systems are registered once with the entities they care about and then run
+// system by system each frame, so a frame costs the sum of each system's
+// matches rather than every system paying for every entity. Phases run in enum
+// order and systems inside a phase run in the order they were registered.
+//
+// Every system gets its own tick: the bucket tick is advanced right before it
+// runs, so its writes are stamped with that tick and lastRunTick tells it what
+// has changed since it last ran without seeing its own writes
+//
+// Systems can declare the component types they read and write. Once the
+// schedule has a JobSystem, each frame is turned into a dependency graph
+// where a system waits for every earlier system it conflicts with (one writes
+// what the other reads or writes), and systems with no path between them run
+// at the same time. Systems that share a wave share a tick, which is safe
+// because none of them can see the others' writes. Anything that doesn't
+// declare its access, or makes structural changes (creating entities, adding
+// or removing components), has to be exclusive and runs on its own.
+// mainThreadOnly systems always run on the thread calling BucketRunFrame
+//
+// An each system too big for one frame can be given an entity budget, a time
+// budget or both. It then visits its matches in entity index order, stops once
+// a budget is spent and carries on from the next match the frame after. Entity
+// indexes don't move as other entities come and go, so an entity that matches
+// for a whole pass is visited exactly once in it, and one added ahead of the
+// cursor is picked up in the same pass.
+//
+// An each system can instead set an updateInterval of N. Each run then visits
+// the matches whose entity index is runCount % N, a stable 1/N slice, and
+// hands them the dt built up since that slice last ran. Budgets and intervals
+// can't be combined, and run systems can use neither since they walk their
+// entities themselves.
+//
+// With a frame budget set, the schedule measures every system's run time and
+// keeps a running average. Before each frame the governor adds those up. If
+// the last frame ran over the target, the overrun comes out of this frame's
+// budget. While the total is over, optional systems (priority above zero) are
+// deferred, lowest priority first. No system is deferred more than
+// minRunInterval - 1 frames in a row, and the dt it misses is added to its
+// next run. The estimate ignores overlap between parallel systems, so it
+// errs towards deferring too much
+
+typedef enum {
+  SYSTEM_PHASE_PRE_UPDATE, // Input, anything the update reads
+  SYSTEM_PHASE_UPDATE,
+  SYSTEM_PHASE_POST_UPDATE, // Reacting to what the update did, collisions
+  SYSTEM_PHASE_RENDER,
+  SYSTEM_PHASE_COUNT,
+} SystemPhase;
+
+struct System;
+
+// Called for every usable match of the system's query
+typedef void (*SystemEachFn)(Bucket *bucket, Entity *entity, float dt,
+                             struct System *system);
+// Called once per frame, for systems that want to walk their matches (or
+// something else entirely) themselves
+typedef void (*SystemRunFn)(Bucket *bucket, struct System *system, float dt);
+
+typedef struct {
+  const char *name;
+  SystemPhase phase;
+  QueryTerms terms; // Empty for systems that don't run over entities
+  SystemEachFn each;
+  SystemRunFn run; // Used instead of each when set
+  void *userData;
+  BitMask reads;      // Component types read, see COMPONENT_MASK
+  BitMask writes;     // Component types written
+  int exclusive;      // Runs alone, implied when reads and writes are empty
+  int mainThreadOnly; // Never moved onto a worker thread (rendering, input)
+  uint32_t entityBudget; // Most entities to process per frame, 0 for all
+  uint64_t timeBudgetNs; // Stop after this long each frame, 0 for no limit
+  int priority; // 0 is never deferred, otherwise lower priorities are
+                // deferred first when the frame is over budget
+  uint32_t minRunInterval; // Runs at least once every this many frames, 0 if
+                           // it can be deferred indefinitely
+  uint32_t updateInterval; // Visit each entity every this many runs, 0 or 1
+                           // for every run
+} SystemDesc;
+
+typedef struct System {
+  const char *name;
+  SystemPhase phase;
+  Query *query; // NULL if the system was registered without terms
+  SystemEachFn each;
+  SystemRunFn run;
+  void *userData;
+  uint32_t lastRunTick; // Tick of the previous run while running, 0 before
+                        // the first
+  uint64_t runCount;
+  uint64_t lastRunNs;      // Only measured while profiling or governed
+  uint32_t lastEntityCount; // Entities the last run processed
+  int disabled;
+  BitMask reads;
+  BitMask writes;
+  int exclusive;
+  int mainThreadOnly;
+  uint32_t entityBudget;
+  uint64_t timeBudgetNs;
+  size_t cursor;      // Entity index a budgeted system resumes from
+  uint64_t passCount; // Times a budgeted system has made it through every
+                      // match
+  int priority;
+  uint32_t minRunInterval;
+  uint64_t costNs;         // Running average of lastRunNs
+  int deferred;            // Deferred for the current frame
+  uint32_t deferredFrames; // Frames deferred in a row
+  uint64_t deferCount;     // Frames deferred in total
+  float pendingDt;         // dt of deferred frames, added to the next run
+  uint32_t updateInterval;
+  float *sliceDt; // dt accumulated by each staggered slice since it last ran
+  struct System *next;
+} System;
+
+#ifndef MAX_SYSTEMS
+#define MAX_SYSTEMS 256
+#endif
+
+typedef struct SystemSchedule {
+  System *first[SYSTEM_PHASE_COUNT];
+  System *last[SYSTEM_PHASE_COUNT];
+  size_t systemCount;
+  uint64_t frame; // Frames run so far
+  JobSystem *jobs; // Systems run one at a time when NULL
+
+  // Per frame scratch for the parallel schedule
+  System *frameSystems[MAX_SYSTEMS];
+  uint32_t waves[MAX_SYSTEMS];
+  uint32_t waveIndexes[MAX_SYSTEMS];
+  System *mainSystems[MAX_SYSTEMS];
+  size_t mainCount;
+  float dt;
+  uint32_t tick;
+  size_t waveCount; // Waves in the last frame, for inspecting the schedule
+  uint64_t lastFrameNs; // Only measured while profiling or governed
+
+  uint64_t targetFrameNs; // Frame budget for the governor, 0 to run everything
+  size_t deferredLastFrame; // Systems the governor deferred last frame
+  uint64_t deferredTotal;
+} SystemSchedule;
+
+System *BucketRegisterSystem(Bucket *bucket, SystemDesc desc) {
+  if (desc.phase >= SYSTEM_PHASE_COUNT || (!desc.each && !desc.run) ||
+      (desc.each && !desc.run && !desc.terms.include && !desc.terms.any) ||
+      (desc.updateInterval > 1 && (desc.entityBudget || desc.timeBudgetNs)) ||
+      (desc.run && (desc.updateInterval > 1 || desc.entityBudget ||
+                    desc.timeBudgetNs)) ||
+      (bucket->schedule && bucket->schedule->systemCount >= MAX_SYSTEMS)) {
+    return NULL;
+  }
+
+  if (!bucket->schedule) {
+    bucket->schedule = ArenaAllocate(bucket->arena, sizeof(SystemSchedule));
+    if (!bucket->schedule) {
+      return NULL;
+    }
+  }
+
+  // rolling back on failure must not hand back the schedule
+  size_t pos = bucket->arena->top;
+
+  System *system = ArenaAllocate(bucket->arena, sizeof(System));
+  if (!system) {
+    bucket->arena->top = pos;
+    return NULL;
+  }
+
+  if (desc.updateInterval > 1) {
+    system->updateInterval = desc.updateInterval;
+    system->sliceDt =
+        ArenaAllocate(bucket->arena, desc.updateInterval * sizeof(float));
+    if (!system->sliceDt) {
+      bucket->arena->top = pos;
+      return NULL;
+    }
+  }
+
+  // the query goes last, once registered it can't be handed back
+  if (desc.terms.include || desc.terms.any) {
+    system->query = BucketRegisterQueryWithTerms(bucket, desc.terms);
+    if (!system->query) {
+      bucket->arena->top = pos;
+      return NULL;
+    }
+  }
+
+  system->name = desc.name;
+  system->phase = desc.phase;
+  system->each = desc.each;
+  system->run = desc.run;
+  system->userData = desc.userData;
+  system->reads = desc.reads;
+  system->writes = desc.writes;
+  system->exclusive = desc.exclusive || (!desc.reads && !desc.writes);
+  system->mainThreadOnly = desc.mainThreadOnly;
+  system->entityBudget = desc.entityBudget;
+  system->timeBudgetNs = desc.timeBudgetNs;
+  system->priority = desc.priority;
+  system->minRunInterval = desc.minRunInterval;
+
+  SystemSchedule *schedule = bucket->schedule;
+  if (schedule->last[desc.phase]) {
+    schedule->last[desc.phase]->next = system;
+  } else {
+    schedule->first[desc.phase] = system;
+  }
+  schedule->last[desc.phase] = system;
+  schedule->systemCount++;
+
+  return system;
+}
+
+System *BucketGetSystem(Bucket *bucket, const char *name) {
+  if (!bucket->schedule || !name) {
+    return NULL;
+  }
+
+  for (int phase = 0; phase < SYSTEM_PHASE_COUNT; phase++) {
+    for (System *system = bucket->schedule->first[phase]; system;
+         system = system->next) {
+      if (system->name && strcmp(system->name, name) == 0) {
+        return system;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Visit matches in entity index order from the cursor until the budget runs
+// out. The walk steps from match to match through the query's members bitset
+// so its cost follows the matches however sparse they are. The clock is read
+// every 16 matches, so a tiny time budget still makes progress each frame
+size_t SystemExecuteBudgeted(Bucket *bucket, System *system, float dt) {
+  Query *query = system->query;
+  uint64_t start = system->timeBudgetNs ? EccNowNs() : 0;
+  size_t processed = 0;
+  size_t visited = 0;
+
+  size_t index = HiBitSetNext(&query->members, system->cursor);
+  while (index < bucket->entityListEnd) {
+    Entity *entity = QueryGetEntity(bucket, query, query->slots[index] - 1);
+    if (entity) {
+      system->each(bucket, entity, dt, system);
+      processed++;
+    }
+
+    // look the next match up after running so anything the system did to
+    // the query is taken into account
+    index = HiBitSetNext(&query->members, index + 1);
+
+    if (system->entityBudget && processed >= system->entityBudget) {
+      break;
+    }
+    if (start && ++visited % 16 == 0 &&
+        EccNowNs() - start >= system->timeBudgetNs) {
+      break;
+    }
+  }
+
+  if (index >= bucket->entityListEnd) {
+    system->cursor = 0;
+    system->passCount++;
+  } else {
+    system->cursor = index;
+  }
+  return processed;
+}
+
+// Visit the slice of matches due this run with the dt it has built up. Walks
+// whichever is shorter, the matches or every N'th entity index
+size_t SystemExecuteStaggered(Bucket *bucket, System *system, float dt) {
+  Query *query = system->query;
+  uint32_t interval = system->updateInterval;
+  uint32_t slice = system->runCount % interval;
+
+  for (uint32_t i = 0; i < interval; i++) {
+    system->sliceDt[i] += dt;
+  }
+  dt = system->sliceDt[slice];
+  system->sliceDt[slice] = 0;
+
+  size_t entities = 0;
+  if (query->count < bucket->entityListEnd / interval) {
+    for (size_t i = 0; i < query->count; i++) {
+      Entity *entity = query->matches[i] % interval == slice
+                           ? QueryGetEntity(bucket, query, i)
+                           : NULL;
+      if (entity) {
+        system->each(bucket, entity, dt, system);
+        entities++;
+      }
+    }
+  } else {
+    for (size_t index = slice; index < bucket->entityListEnd;
+         index += interval) {
+      uint32_t slot = query->slots[index];
+      Entity *entity = slot ? QueryGetEntity(bucket, query, slot - 1) : NULL;
+      if (entity) {
+        system->each(bucket, entity, dt, system);
+        entities++;
+      }
+    }
+  }
+  return entities;
+}
+
+void SystemExecute(Bucket *bucket, System *system, float dt, uint32_t tick) {
+  int governed = bucket->schedule->targetFrameNs != 0;
+  uint64_t start = governed ? EccNowNs() : ProfileBegin();
+  size_t entities = 0;
+
+  dt += system->pendingDt;
+  system->pendingDt = 0;
+  system->deferredFrames = 0;
+
+  if (system->run) {
+    system->run(bucket, system, dt);
+    // run systems are free to ignore their query, it's the best guess
+    entities = system->query ? system->query->count : 0;
+  } else if (system->entityBudget || system->timeBudgetNs) {
+    entities = SystemExecuteBudgeted(bucket, system, dt);
+  } else if (system->updateInterval) {
+    entities = SystemExecuteStaggered(bucket, system, dt);
+  } else {
+    // matches added while running are picked up, removing matches from the
+    // system's own query can make it skip an entity until next frame
+    Query *query = system->query;
+    for (size_t i = 0; i < query->count; i++) {
+      Entity *entity = QueryGetEntity(bucket, query, i);
+      if (entity) {
+        system->each(bucket, entity, dt, system);
+        entities++;
+      }
+    }
+  }
+
+  system->lastRunTick = tick;
+  system->runCount++;
+  system->lastEntityCount = entities;
+  if (start) {
+    system->lastRunNs = EccNowNs() - start;
+    system->costNs = system->runCount > 1
+                         ? (system->costNs * 7 + system->lastRunNs) / 8
+                         : system->lastRunNs;
+    if (ProfilerEnabled()) {
+      ProfileEnd(system->name, PROFILE_SYSTEM, start, entities);
+    }
+  }
+}
+
+// Run one system now, outside of the frame order
+void BucketRunSystem(Bucket *bucket, System *system, float dt) {
+  SystemExecute(bucket, system, dt, BucketAdvanceTick(bucket));
+}
+
+int SystemsConflict(System *a, System *b) {
+  return a->exclusive || b->exclusive || (a->writes & (b->reads | b->writes)) ||
+         (b->writes & a->reads);
+}
+
+// Run systems in parallel on a job system
+void BucketSetJobSystem(Bucket *bucket, JobSystem *jobs) {
+  if (!bucket->schedule) {
+    bucket->schedule = ArenaAllocate(bucket->arena, sizeof(SystemSchedule));
+    if (!bucket->schedule) {
+      return;
+    }
+  }
+  bucket->schedule->jobs = jobs;
+}
+
+void ScheduleRunWorkerSystems(Bucket *bucket, const uint32_t *systemIndexes,
+                              size_t count, void *userData, int worker) {
+  SystemSchedule *schedule = userData;
+  for (size_t i = 0; i < count; i++) {
+    SystemExecute(bucket, schedule->frameSystems[systemIndexes[i]],
+                  schedule->dt, schedule->tick);
+  }
+}
+
+void ScheduleRunMainSystems(void *data) {
+  Bucket *bucket = data;
+  SystemSchedule *schedule = bucket->schedule;
+  for (size_t i = 0; i < schedule->mainCount; i++) {
+    SystemExecute(bucket, schedule->mainSystems[i], schedule->dt,
+                  schedule->tick);
+  }
+}
+
+// Keep frames within targetFrameNs by deferring optional systems, 0 turns the
+// governor off
+void BucketSetFrameBudget(Bucket *bucket, uint64_t targetFrameNs) {
+  if (!bucket->schedule) {
+    bucket->schedule = ArenaAllocate(bucket->arena, sizeof(SystemSchedule));
+    if (!bucket->schedule) {
+      return;
+    }
+  }
+  bucket->schedule->targetFrameNs = targetFrameNs;
+}
+
+// Whether the governor may defer a system this frame
+int SystemDeferrable(System *system) {
+  return !system->disabled && !system->deferred && system->priority > 0 &&
+         system->costNs > 0 &&
+         (!system->minRunInterval ||
+          system->deferredFrames + 1 < system->minRunInterval);
+}
+
+// Pick the systems to defer for the coming frame from their measured costs
+void ScheduleGovernFrame(SystemSchedule *schedule, float dt) {
+  uint64_t projected = 0;
+  for (int phase = 0; phase < SYSTEM_PHASE_COUNT; phase++) {
+    for (System *system = schedule->first[phase]; system;
+         system = system->next) {
+      system->deferred = 0;
+      projected += system->disabled ? 0 : system->costNs;
+    }
+  }
+
+  uint64_t allowance = schedule->targetFrameNs;
+  if (schedule->lastFrameNs > allowance) {
+    uint64_t overrun = schedule->lastFrameNs - allowance;
+    allowance = overrun < allowance ? allowance - overrun : 0;
+  }
+
+  schedule->deferredLastFrame = 0;
+  while (projected > allowance) {
+    // lowest priority first, the most expensive of those sheds the most
+    System *victim = NULL;
+    for (int phase = 0; phase < SYSTEM_PHASE_COUNT; phase++) {
+      for (System *system = schedule->first[phase]; system;
+           system = system->next) {
+        if (SystemDeferrable(system) &&
+            (!victim || system->priority < victim->priority ||
+             (system->priority == victim->priority &&
+              system->costNs > victim->costNs))) {
+          victim = system;
+        }
+      }
+    }
+    if (!victim) {
+      break;
+    }
+
+    victim->deferred = 1;
+    victim->deferredFrames++;
+    victim->deferCount++;
+    victim->pendingDt += dt;
+    projected -= victim->costNs;
+    schedule->deferredLastFrame++;
+  }
+  schedule->deferredTotal += schedule->deferredLastFrame;
+}
+
+// Place every system in the earliest wave after everything it conflicts with
+// that comes before it in phase order, then run the waves one after another
+void BucketRunFrameParallel(Bucket *bucket, float dt) {
+  SystemSchedule *schedule = bucket->schedule;
+
+  size_t count = 0;
+  size_t waveCount = 0;
+  for (int phase = 0; phase < SYSTEM_PHASE_COUNT; phase++) {
+    for (System *system = schedule->first[phase]; system;
+         system = system->next) {
+      if (system->disabled || system->deferred) {
+        continue;
+      }
+
+      uint32_t wave = 0;
+      for (size_t i = 0; i < count; i++) {
+        if (schedule->waves[i] >= wave &&
+            SystemsConflict(schedule->frameSystems[i], system)) {
+          wave = schedule->waves[i] + 1;
+        }
+      }
+      schedule->frameSystems[count] = system;
+      schedule->waves[count++] = wave;
+      waveCount = wave + 1 > waveCount ? wave + 1 : waveCount;
+    }
+  }
+
+  schedule->dt = dt;
+  for (uint32_t wave = 0; wave < waveCount; wave++) {
+    size_t workerCount = 0;
+    schedule->mainCount = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (schedule->waves[i] != wave) {
+        continue;
+      }
+      if (schedule->frameSystems[i]->mainThreadOnly) {
+        schedule->mainSystems[schedule->mainCount++] =
+            schedule->frameSystems[i];
+      } else {
+        schedule->waveIndexes[workerCount++] = i;
+      }
+    }
+
+    uint64_t start = ProfileBegin();
+    schedule->tick = BucketAdvanceTick(bucket);
+    ParallelForIndexesWhile(
+        schedule->jobs, bucket, schedule->waveIndexes, workerCount, 1,
+        ScheduleRunWorkerSystems, schedule,
+        schedule->mainCount ? ScheduleRunMainSystems : NULL, bucket);
+    ProfileEnd("Wave", PROFILE_PHASE, start, 0);
+  }
+  schedule->waveCount = waveCount;
+}
+
+void BucketRunPhase(Bucket *bucket, SystemPhase phase, float dt) {
+  static const char *phaseNames[] = {"PreUpdate", "Update", "PostUpdate",
+                                     "Render"};
+
+  if (!bucket->schedule || !bucket->schedule->first[phase]) {
+    return;
+  }
+
+  uint64_t start = ProfileBegin();
+  for (System *system = bucket->schedule->first[phase]; system;
+       system = system->next) {
+    if (!system->disabled && !system->deferred) {
+      BucketRunSystem(bucket, system, dt);
+    }
+  }
+  ProfileEnd(phaseNames[phase], PROFILE_PHASE, start, 0);
+}
+
+// Run every enabled system once, phase by phase, or wave by wave when the
+// schedule has a job system. Systems the governor defers sit the frame out
+void BucketRunFrame(Bucket *bucket, float dt) {
+  SystemSchedule *schedule = bucket->schedule;
+  if (!schedule) {
+    return;
+  }
+
+  uint64_t start = schedule->targetFrameNs ? EccNowNs() : ProfileBegin();
+  if (schedule->targetFrameNs) {
+    ScheduleGovernFrame(schedule, dt);
+  }
+
+  if (schedule->jobs) {
+    BucketRunFrameParallel(bucket, dt);
+  } else {
+    for (int phase = 0; phase < SYSTEM_PHASE_COUNT; phase++) {
+      BucketRunPhase(bucket, phase, dt);
+    }
+  }
+  schedule->frame++;
+
+  // deferrals only apply to the frame they were made for
+  if (schedule->targetFrameNs) {
+    for (int phase = 0; phase < SYSTEM_PHASE_COUNT; phase++) {
+      for (System *system = schedule->first[phase]; system;
+           system = system->next) {
+        system->deferred = 0;
+      }
+    }
+  }
+
+  if (start) {
+    schedule->lastFrameNs = EccNowNs() - start;
+    if (ProfilerEnabled()) {
+      ProfileEnd("Frame", PROFILE_FRAME, start, bucket->entityCount);
     }
   }
-  return NULL;
 }
@@ -3,6 +3,7 @@
 #include "raymath.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 const int KB = 1024;
 const int MB = 1024 * 1024;
@@ -31,10 +32,7 @@ typedef struct {
 typedef Vector2 Direction;
 typedef float Speed;
 typedef Vector2 Scale;
-typedef struct SnakeNode {
-  struct SnakeNode *next;
-  Entity *entity;
-} SnakeNode;
+typedef short SnakeNode;
 typedef struct {
   float angle;
 } Rotation;
@@ -50,9 +48,11 @@ enum GameMode { RUNNING, OVER };
 typedef struct {
   Bucket *bucket;
   Arena *frameArena;
-  SnakeNode *tailTip;
+  Entity *tailTip;
   Entity *snakeHead;
   Entity *apple;
+  SpatialGrid *grid;
+  JobSystem *jobs;
   int screenWidth;
   int screenHeight;
   int score;
@@ -73,20 +73,19 @@ Vector2 ToGridPos(Vector2 position, int gridSize) {
 void AddSnakeNode(GameState *gameState) {
   Entity *snakeEntity = BucketCreateEntity(gameState->bucket);
 
-  SnakeNode *node =
-      ADD_COMPONENT_TO_ENTITY(gameState->bucket, snakeEntity, SnakeNode);
-  node->next = gameState->tailTip;
-  node->entity = snakeEntity;
+  ADD_COMPONENT_TO_ENTITY(gameState->bucket, snakeEntity, SnakeNode);
+  // each segment follows the one in front of it
+  BucketSetParent(gameState->bucket, snakeEntity, gameState->tailTip);
 
   GridPosition *tailPos = GET_COMPONENT_FROM_ENTITY(
-      gameState->bucket, gameState->tailTip->entity, GridPosition);
+      gameState->bucket, gameState->tailTip, GridPosition);
   if (!tailPos) {
     // If we reach here something has gone seriously wrong...
     printf("NO TAIL POSITION\n");
     exit(1);
   }
 
-  gameState->tailTip = node;
+  gameState->tailTip = snakeEntity;
 
   GridPosition *nodeGridPos =
       ADD_COMPONENT_TO_ENTITY(gameState->bucket, snakeEntity, GridPosition);
@@ -95,45 +94,51 @@ void AddSnakeNode(GameState *gameState) {
   nodeGridPos->lastPos.x = 0;
   nodeGridPos->lastPos.y = 0;
 
-  Scale *nodeScale =
-      ADD_COMPONENT_TO_ENTITY(gameState->bucket, snakeEntity, Scale);
-  nodeScale->x = GRID_SQUARE_SIZE;
-  nodeScale->y = GRID_SQUARE_SIZE;
+  // every segment looks the same so they all share one Scale and Renderer
+  SET_SHARED_COMPONENT_FOR_ENTITY(gameState->bucket, snakeEntity, Scale,
+                                  ((Scale){GRID_SQUARE_SIZE, GRID_SQUARE_SIZE}));
 
-  Renderer *nodeRenderer =
-      ADD_COMPONENT_TO_ENTITY(gameState->bucket, snakeEntity, Renderer);
-  nodeRenderer->color = SNAKE_BODY_COL;
+  SET_SHARED_COMPONENT_FOR_ENTITY(gameState->bucket, snakeEntity, Renderer,
+                                  ((Renderer){SNAKE_BODY_COL}));
 }
 
-void AppleEaterSystem(GameState *gameState, Entity *entity) {
-  if (!entity) {
-    return;
-  }
+void AppleEaterSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
+  GameState *gameState = system->userData;
 
   GridPosition *gridPosition =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, GridPosition);
+      GET_COMPONENT_FROM_ENTITY(bucket, entity, GridPosition);
   SnakeNode *snakeNode =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, SnakeNode);
+      GET_COMPONENT_FROM_ENTITY(bucket, entity, SnakeNode);
   SnakeHead *snakeHead =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, SnakeHead);
+      GET_COMPONENT_FROM_ENTITY(bucket, entity, SnakeHead);
 
   // we only want the head node
   if (!snakeHead || !gridPosition || !snakeNode) {
     return;
   }
 
-  GridPosition *applePosition = GET_COMPONENT_FROM_ENTITY(
-      gameState->bucket, gameState->apple, GridPosition);
+  GridPosition *applePosition = GET_MUTABLE_COMPONENT_FROM_ENTITY(
+      bucket, gameState->apple, GridPosition);
 
   if (!applePosition) {
     printf("NO APPLE FOUND!!!\n");
     return;
   }
 
-  Vector2 diff =
-      Vector2Subtract(gridPosition->currentPos, applePosition->currentPos);
+  // everything sits on grid squares so anything sharing the head's cell is
+  // touching it
+  SpatialGridUpdate(gameState->grid);
+  uint32_t touching[MAX_ENTITIES];
+  size_t touchingCount =
+      SpatialGridQueryCell(gameState->grid, gridPosition->currentPos.x,
+                           gridPosition->currentPos.y, touching, MAX_ENTITIES);
+
+  int eating = 0;
+  for (size_t i = 0; i < touchingCount; i++) {
+    eating |= touching[i] == gameState->apple->index;
+  }
 
-  if (diff.x == 0 && diff.y == 0) {
+  if (eating) {
     // Eat apple
     AddSnakeNode(gameState);
     applePosition->currentPos.x =
@@ -146,34 +151,29 @@ void AppleEaterSystem(GameState *gameState, Entity *entity) {
   }
 }
 
-void SnakeTailMovementSystem(GameState *gameState) {
-
-  SnakeNode *tailTip = gameState->tailTip;
-  if (!tailTip) {
-    return;
-  }
-
-  GridPosition *gridPosition = GET_COMPONENT_FROM_ENTITY(
-      gameState->bucket, tailTip->entity, GridPosition);
-
-  if (tailTip->entity == gameState->snakeHead) {
-    GridPosition *moveToPosition = GET_COMPONENT_FROM_ENTITY(
-        gameState->bucket, gameState->snakeHead, GridPosition);
-    gridPosition->currentPos = moveToPosition->currentPos;
-    return;
-  }
-
-  while (tailTip->next) {
+void SnakeTailMovementSystem(Bucket *bucket, System *system, float dt) {
+  size_t orderCount;
+  const uint32_t *order = BucketHierarchyOrder(
+      bucket, HIERARCHY_BREADTH_FIRST, &orderCount);
+
+  // walk from the tail tip towards the head so every segment reads where the
+  // one in front of it was before that one moves
+  for (size_t i = orderCount; i > 0; i--) {
+    Entity *segment = bucket->entities[order[i - 1]];
+    Entity *leader = BucketGetParent(bucket, segment);
+    if (!leader) {
+      continue;
+    }
 
-    GridPosition *gridPosition = GET_COMPONENT_FROM_ENTITY(
-        gameState->bucket, tailTip->entity, GridPosition);
+    GridPosition *gridPosition = GET_MUTABLE_COMPONENT_FROM_ENTITY(
+        bucket, segment, GridPosition);
 
     if (!gridPosition) {
       return;
     }
 
-    GridPosition *moveToPosition = GET_COMPONENT_FROM_ENTITY(
-        gameState->bucket, tailTip->next->entity, GridPosition);
+    GridPosition *moveToPosition =
+        GET_COMPONENT_FROM_ENTITY(bucket, leader, GridPosition);
 
     if (!moveToPosition) {
       return;
@@ -185,40 +185,35 @@ void SnakeTailMovementSystem(GameState *gameState) {
     if (Vector2Distance(gridPosition->currentPos, previousPosition) != 0) {
       gridPosition->lastPos = previousPosition;
     }
-    tailTip = tailTip->next;
   }
 }
 
-void HeadCollisionSystem(GameState *gameState, Entity *entity) {
-  if (!entity) {
-    return;
-  }
-
-  if (entity == gameState->snakeHead) {
-    return;
-  }
-
-  GridPosition *gridPosition =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, GridPosition);
+void HeadCollisionSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
+  GameState *gameState = system->userData;
 
-  SnakeNode *node =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, SnakeNode);
-  if (!gridPosition || !node) {
-    return;
-  }
-
-  GridPosition *headPosition = GET_COMPONENT_FROM_ENTITY(
-      gameState->bucket, gameState->snakeHead, GridPosition);
+  // the system only runs for the head, and the grid finds what it hit without
+  // checking every tail node
+  GridPosition *headPosition =
+      GET_COMPONENT_FROM_ENTITY(bucket, entity, GridPosition);
 
   if (!headPosition) {
     // Shouldn't happen, this is a bug
-    printf(
-        "CRITICAL ERROR: Tail node does not have a GridPosition component\n");
+    printf("CRITICAL ERROR: Snake head does not have a GridPosition component\n");
     exit(1);
   }
 
-  int eatingTail =
-      Vector2Distance(gridPosition->currentPos, headPosition->currentPos) == 0;
+  SpatialGridUpdate(gameState->grid);
+  uint32_t touching[MAX_ENTITIES];
+  size_t touchingCount =
+      SpatialGridQueryCell(gameState->grid, headPosition->currentPos.x,
+                           headPosition->currentPos.y, touching, MAX_ENTITIES);
+
+  int eatingTail = 0;
+  for (size_t i = 0; i < touchingCount; i++) {
+    Entity *other = bucket->entities[touching[i]];
+    eatingTail |= other != entity &&
+                  GET_COMPONENT_FROM_ENTITY(bucket, other, SnakeNode);
+  }
 
   int outOfBounds = (headPosition->currentPos.x > (gameState->screenWidth - GRID_SQUARE_SIZE)) ||
                     (headPosition->currentPos.x < 0) ||
@@ -231,23 +226,23 @@ void HeadCollisionSystem(GameState *gameState, Entity *entity) {
   }
 }
 
-void HeadMovementSystem(GameState *gameState, Entity *entity, float dt) {
-  if (!entity) {
-    return;
-  }
+void HeadMovementSystem(Bucket *bucket, Entity *entity, float dt,
+                        System *system) {
 
-  Position *position =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Position);
-  GridPosition *gridPosition =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, GridPosition);
-  Direction *direction =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Direction);
-  Speed *speed = GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Speed);
-
-  if (!direction || !position || !gridPosition || !speed) {
+  // positions feed the spatial grid so the two being written are stamped as
+  // changed
+  void *components[4];
+  if (!GET_MUTABLE_COMPONENTS_FROM_ENTITY(bucket, entity, components, 2,
+                                          Position, GridPosition, Direction,
+                                          Speed)) {
     return;
   }
 
+  Position *position = components[0];
+  GridPosition *gridPosition = components[1];
+  Direction *direction = components[2];
+  Speed *speed = components[3];
+
   *position = Vector2Add(*position, Vector2Scale(*direction, *speed * dt));
 
   Vector2 previousPosition = gridPosition->currentPos;
@@ -257,13 +252,10 @@ void HeadMovementSystem(GameState *gameState, Entity *entity, float dt) {
   }
 }
 
-void SetDirectionSystem(GameState *gameState, Entity *entity) {
-  if (!entity) {
-    return;
-  }
-  Input *input = GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Input);
+void SetDirectionSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
+  Input *input = GET_COMPONENT_FROM_ENTITY(bucket, entity, Input);
   Direction *direction =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Direction);
+      GET_COMPONENT_FROM_ENTITY(bucket, entity, Direction);
 
   if (!direction || !input) {
     return;
@@ -291,13 +283,9 @@ void SetDirectionSystem(GameState *gameState, Entity *entity) {
   }
 }
 
-void InputSystem(GameState *gameState, Entity *entity) {
+void InputSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
 
-  if (!entity) {
-    return;
-  }
-
-  Input *input = GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Input);
+  Input *input = GET_COMPONENT_FROM_ENTITY(bucket, entity, Input);
 
   if (!input) {
     // printf("NO INPUT COMPONENT FOR THIS ENTITY\n");
@@ -333,15 +321,12 @@ void InputSystem(GameState *gameState, Entity *entity) {
   }
 }
 
-void RenderSystem(GameState *gameState, Entity *entity) {
-  if (!entity) {
-    return;
-  }
-  Renderer *renderer =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Renderer);
+void RenderSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
+  const Renderer *renderer =
+      GET_SHARED_COMPONENT_FROM_ENTITY(bucket, entity, Renderer);
   GridPosition *gridPosition =
-      GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, GridPosition);
-  Scale *scale = GET_COMPONENT_FROM_ENTITY(gameState->bucket, entity, Scale);
+      GET_COMPONENT_FROM_ENTITY(bucket, entity, GridPosition);
+  const Scale *scale = GET_SHARED_COMPONENT_FROM_ENTITY(bucket, entity, Scale);
 
   if (!renderer || !gridPosition || !scale) {
     return;
@@ -357,6 +342,64 @@ void RenderSystem(GameState *gameState, Entity *entity) {
       renderer->color);
 }
 
+// Each system runs once per frame over just the entities it needs. Declaring
+// what they read and write lets the systems that don't touch each other's
+// components run at the same time on the job system
+void RegisterSystems(GameState *gameState) {
+  Bucket *bucket = gameState->bucket;
+
+  // input is polled in EndDrawing, so reading the queue from a worker while
+  // the frame runs is fine
+  REGISTER_SYSTEM(bucket, .name = "Input", .phase = SYSTEM_PHASE_PRE_UPDATE,
+                  .terms = {.include = COMPONENT_MASK(bucket, Input)},
+                  .each = InputSystem, .userData = gameState,
+                  .writes = COMPONENT_MASK(bucket, Input));
+  REGISTER_SYSTEM(
+      bucket, .name = "SetDirection", .phase = SYSTEM_PHASE_PRE_UPDATE,
+      .terms = {.include = COMPONENT_MASK(bucket, Input, Direction)},
+      .each = SetDirectionSystem, .userData = gameState,
+      .reads = COMPONENT_MASK(bucket, Input),
+      .writes = COMPONENT_MASK(bucket, Direction));
+
+  // eating grows the snake, which creates entities
+  REGISTER_SYSTEM(
+      bucket, .name = "AppleEater", .phase = SYSTEM_PHASE_UPDATE,
+      .terms = {.include = COMPONENT_MASK(bucket, AppleEater, GridPosition)},
+      .each = AppleEaterSystem, .userData = gameState, .exclusive = 1);
+  REGISTER_SYSTEM(bucket, .name = "SnakeTailMovement",
+                  .phase = SYSTEM_PHASE_UPDATE, .run = SnakeTailMovementSystem,
+                  .userData = gameState,
+                  .writes = COMPONENT_MASK(bucket, GridPosition));
+  REGISTER_SYSTEM(bucket, .name = "HeadMovement", .phase = SYSTEM_PHASE_UPDATE,
+                  .terms = {.include = COMPONENT_MASK(bucket, Position,
+                                                      GridPosition, Direction,
+                                                      Speed)},
+                  .each = HeadMovementSystem, .userData = gameState,
+                  .reads = COMPONENT_MASK(bucket, Direction, Speed),
+                  .writes = COMPONENT_MASK(bucket, Position, GridPosition));
+
+  // the spatial grid isn't a component, keeping the only other system that
+  // touches it exclusive and this one on the main thread keeps them apart
+  REGISTER_SYSTEM(
+      bucket, .name = "HeadCollision", .phase = SYSTEM_PHASE_POST_UPDATE,
+      .terms = {.include = COMPONENT_MASK(bucket, SnakeHead, GridPosition)},
+      .each = HeadCollisionSystem, .userData = gameState,
+      .reads = COMPONENT_MASK(bucket, SnakeHead, SnakeNode, GridPosition),
+      .mainThreadOnly = 1);
+
+  // raylib wants drawing on the thread that owns the window
+  REGISTER_SYSTEM(bucket, .name = "Render", .phase = SYSTEM_PHASE_RENDER,
+                  .terms = {.include = COMPONENT_MASK(bucket, Renderer,
+                                                      GridPosition, Scale)},
+                  .each = RenderSystem, .userData = gameState,
+                  .reads = COMPONENT_MASK(bucket, Renderer, GridPosition,
+                                          Scale),
+                  .mainThreadOnly = 1);
+
+  gameState->jobs = JobSystemCreate(sysconf(_SC_NPROCESSORS_ONLN), 1);
+  BucketSetJobSystem(bucket, gameState->jobs);
+}
+
 // void ScoreDisplaySystem(GameState *gameState) {
 //   DrawText(gameState->score, gameState->screenWidth / 2, 0, 22, GREEN);
 // }
@@ -393,14 +436,11 @@ GameState *InitialiseGame() {
   snakeDir->x = 0;
   snakeDir->y = 0;
 
-  Scale *snakeScale =
-      ADD_COMPONENT_TO_ENTITY(gameWorld, gameState->snakeHead, Scale);
-  snakeScale->x = GRID_SQUARE_SIZE;
-  snakeScale->y = GRID_SQUARE_SIZE;
+  SET_SHARED_COMPONENT_FOR_ENTITY(gameWorld, gameState->snakeHead, Scale,
+                                  ((Scale){GRID_SQUARE_SIZE, GRID_SQUARE_SIZE}));
 
-  Renderer *snakeRenderer =
-      ADD_COMPONENT_TO_ENTITY(gameWorld, gameState->snakeHead, Renderer);
-  snakeRenderer->color = SNAKE_HEAD_COL;
+  SET_SHARED_COMPONENT_FOR_ENTITY(gameWorld, gameState->snakeHead, Renderer,
+                                  ((Renderer){SNAKE_HEAD_COL}));
 
   AppleEater *appleEater =
       ADD_COMPONENT_TO_ENTITY(gameWorld, gameState->snakeHead, AppleEater);
@@ -416,12 +456,9 @@ GameState *InitialiseGame() {
   Input *input =
       ADD_COMPONENT_TO_ENTITY(gameWorld, gameState->snakeHead, Input);
 
-  SnakeNode *snakeHeadNode =
-      ADD_COMPONENT_TO_ENTITY(gameWorld, gameState->snakeHead, SnakeNode);
-  snakeHeadNode->next = NULL;
-  snakeHeadNode->entity = gameState->snakeHead;
+  ADD_COMPONENT_TO_ENTITY(gameWorld, gameState->snakeHead, SnakeNode);
 
-  gameState->tailTip = snakeHeadNode;
+  gameState->tailTip = gameState->snakeHead;
 
   // Setup apple
   Entity *apple = BucketCreateEntity(gameWorld);
@@ -439,16 +476,20 @@ GameState *InitialiseGame() {
   appleGridPos->lastPos.x = 0;
   appleGridPos->lastPos.y = 0;
 
-  Scale *appleScale = ADD_COMPONENT_TO_ENTITY(gameWorld, apple, Scale);
-  appleScale->x = GRID_SQUARE_SIZE;
-  appleScale->y = GRID_SQUARE_SIZE;
+  SET_SHARED_COMPONENT_FOR_ENTITY(gameWorld, apple, Scale,
+                                  ((Scale){GRID_SQUARE_SIZE, GRID_SQUARE_SIZE}));
 
-  Renderer *appleRenderer = ADD_COMPONENT_TO_ENTITY(gameWorld, apple, Renderer);
-  appleRenderer->color = APPLE_COL;
+  SET_SHARED_COMPONENT_FOR_ENTITY(gameWorld, apple, Renderer,
+                                  ((Renderer){APPLE_COL}));
 
   gameState->apple = apple;
   gameState->score = 0;
 
+  gameState->grid = SPATIAL_GRID_CREATE(gameWorld, GridPosition, currentPos.x,
+                                        currentPos.y, GRID_SQUARE_SIZE);
+
+  RegisterSystems(gameState);
+
   return gameState;
 }
 
@@ -463,6 +504,10 @@ int main(void) {
 
   printf("GAME STATE INITIALISED\n");
 
+  // SNECC_TRACE=trace.json writes a Chrome trace of the last frames on exit
+  const char *tracePath = getenv("SNECC_TRACE");
+  ProfilerEnable(tracePath != NULL);
+
   InitWindow(gameState->screenWidth, gameState->screenHeight, "snecc example");
 
   SetTargetFPS(60);
@@ -472,30 +517,16 @@ int main(void) {
     ClearBackground(BLACK);
     DrawFPS(0, 0);
 
-    for (int i = 0; i < gameState->bucket->entityListEnd; i++) {
-      Entity *entity = gameState->bucket->entities[i];
-      if (!entity) {
-        continue;
-      }
-
-      InputSystem(gameState, entity);
-
-      SetDirectionSystem(gameState, entity);
+    BucketRunFrame(gameState->bucket, GetFrameTime());
 
-      AppleEaterSystem(gameState, entity);
-
-      SnakeTailMovementSystem(gameState);
-
-      HeadMovementSystem(gameState, entity, GetFrameTime());
-
-      HeadCollisionSystem(gameState, entity);
-
-      RenderSystem(gameState, entity);
-    }
     EndDrawing();
   }
 
   printf("Game over! Final Score: %d\n", gameState->score);
+  if (tracePath && !ProfilerWriteChromeTrace(tracePath)) {
+    printf("Couldn't write trace to %s\n", tracePath);
+  }
+  JobSystemDestroy(gameState->jobs);
   EndGame(gameState->bucket);
 
   CloseWindow();
@@ -0,0 +1,840 @@
+// Benchmarks for how ecc scales, see `make bench`. Every case runs a few
+// untimed warm up trials and then a number of timed ones, reporting the median
+// and p99 on stdout and as JSON for tooling
+//
+//   ./build/bench_suite [--trials N] [--warmup N] [--json path]
+//                       [--filter substring] [--counters]
+//
+// Bucket storage is sized by MAX_ENTITIES at compile time so the suite builds
+// ecc with room for a million entities, anything bigger is reported as
+// skipped. Rebuild with a larger MAX_ENTITIES to run the bigger sizes. Per
+// possible entity the bucket reserves an 8 byte entry slot for each of the
+// MAX_COMPONENT_TYPES types plus 48 bytes for the entity itself (its 24 byte
+// Entity padded to 32 by the arena, its entities[] pointer and its entry in
+// enabledMasks) up front. Every registered type adds about 24 more (a 16 byte
+// aligned placeholder entry and its added and changed ticks) before any
+// component is added
+
+#ifndef MAX_ENTITIES
+#define MAX_ENTITIES 1000000
+#endif
+
+#include "ecc.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define DEFAULT_TRIALS 9
+#define DEFAULT_WARMUP 2
+#define MAX_BENCH_RESULTS 256
+#define MAX_BENCH_TRIALS 1000
+
+typedef struct {
+  float value[4];
+} C1;
+typedef struct {
+  float value[4];
+} C2;
+typedef struct {
+  float value[4];
+} C3;
+typedef struct {
+  float value[4];
+} C4;
+typedef struct {
+  float value[4];
+} C5;
+typedef struct {
+  float value[4];
+} C6;
+typedef struct {
+  float value[4];
+} C7;
+typedef struct {
+  float value[4];
+} C8;
+
+const size_t benchSizes[] = {1000, 10000, 100000, 1000000, 10000000};
+#define BENCH_SIZE_COUNT (sizeof(benchSizes) / sizeof(benchSizes[0]))
+
+// Hardware counters
+// ---------------------------------------------------------------------------------------------------
+
+// With --counters the timed trials of every case are also measured with
+// perf_event_open and reported per entity, e.g. LLC misses per entity
+// iterated. Only user space is counted so perf_event_paranoid up to 2 is
+// fine. Counters that can't be opened (no PMU under a VM, a stricter paranoid
+// setting, not Linux) are left out and the suite carries on timing
+
+typedef enum {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_L1D_MISSES,
+  COUNTER_LLC_MISSES,
+  COUNTER_DTLB_MISSES,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_COUNT,
+} BenchCounter;
+
+const char *counterNames[COUNTER_COUNT] = {
+    "cycles",    "instructions", "l1dMisses",
+    "llcMisses", "dtlbMisses",   "branchMisses"};
+
+typedef struct {
+  int fds[COUNTER_COUNT]; // -1 for counters that couldn't be opened
+  int open;               // Number of counters that could be opened
+  char error[128];        // Why the first counter that failed did
+} BenchCounters;
+
+BenchCounters counters;
+
+#ifdef __linux__
+int CounterOpen(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // counters share the PMU, when there are more than it has they take turns
+  // and the totals are scaled up by how long each was running
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t CacheMissConfig(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+#endif
+
+// Open whichever counters the machine will give us, returns how many
+int BenchCountersOpen() {
+  counters.open = 0;
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    counters.fds[i] = -1;
+  }
+
+#ifdef __linux__
+  uint32_t types[COUNTER_COUNT] = {
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+      PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+  uint64_t configs[COUNTER_COUNT] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      CacheMissConfig(PERF_COUNT_HW_CACHE_L1D),
+      CacheMissConfig(PERF_COUNT_HW_CACHE_LL),
+      CacheMissConfig(PERF_COUNT_HW_CACHE_DTLB),
+      PERF_COUNT_HW_BRANCH_MISSES};
+
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    counters.fds[i] = CounterOpen(types[i], configs[i]);
+    if (counters.fds[i] >= 0) {
+      counters.open++;
+    } else if (!counters.error[0]) {
+      snprintf(counters.error, sizeof(counters.error), "%s: %s",
+               counterNames[i], strerror(errno));
+    }
+  }
+#else
+  snprintf(counters.error, sizeof(counters.error),
+           "perf_event_open is Linux only");
+#endif
+  return counters.open;
+}
+
+void BenchCountersStart() {
+#ifdef __linux__
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    if (counters.fds[i] >= 0) {
+      ioctl(counters.fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters.fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+}
+
+// Stop counting and add what was counted to totals. valid is cleared for any
+// counter that never got onto the PMU
+void BenchCountersStop(double *totals, int *valid) {
+#ifdef __linux__
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    if (counters.fds[i] >= 0) {
+      ioctl(counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    uint64_t value[3]; // count, time enabled, time running
+    if (counters.fds[i] < 0 ||
+        read(counters.fds[i], value, sizeof(value)) != sizeof(value) ||
+        !value[2]) {
+      valid[i] = 0;
+      continue;
+    }
+    totals[i] += (double)value[0] * value[1] / value[2];
+  }
+#endif
+}
+
+void BenchCountersClose() {
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    if (counters.fds[i] >= 0) {
+      close(counters.fds[i]);
+      counters.fds[i] = -1;
+    }
+  }
+  counters.open = 0;
+}
+
+// Harness
+// ---------------------------------------------------------------------------------------------------
+
+typedef struct {
+  const char *name;
+  size_t entities; // Entities each trial touches, for per entity figures
+  void (*run)(void *ctx);
+  void (*reset)(void *ctx); // Untimed set up before every trial, may be NULL
+  void *ctx;
+} BenchCase;
+
+typedef struct {
+  char name[64];
+  size_t entities;
+  int skipped;
+  char reason[128]; // Why a skipped case didn't run
+  uint64_t medianNs;
+  uint64_t p99Ns;
+  uint64_t minNs;
+  uint64_t maxNs;
+  int hasCounter[COUNTER_COUNT];
+  double perEntity[COUNTER_COUNT]; // Counter values per entity per trial
+} BenchResult;
+
+typedef struct {
+  int trials;
+  int warmup;
+  const char *jsonPath;
+  const char *filter;
+  int counters; // Read hardware counters around the timed trials
+  BenchResult results[MAX_BENCH_RESULTS];
+  size_t resultCount;
+} BenchSuite;
+
+BenchSuite suite = {DEFAULT_TRIALS, DEFAULT_WARMUP, "build/bench_suite.json",
+                    NULL, 0};
+
+// Somewhere for iteration results to go so the work can't be optimised away
+volatile float benchSink;
+
+int CompareNs(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int BenchSelected(const char *name) {
+  return !suite.filter || strstr(name, suite.filter);
+}
+
+BenchResult *BenchAddResult(const char *name, size_t entities) {
+  if (suite.resultCount >= MAX_BENCH_RESULTS) {
+    return NULL;
+  }
+  BenchResult *result = &suite.results[suite.resultCount++];
+  memset(result, 0, sizeof(*result));
+  snprintf(result->name, sizeof(result->name), "%s", name);
+  result->entities = entities;
+  return result;
+}
+
+void BenchSkip(const char *name, size_t entities, const char *reason) {
+  if (!BenchSelected(name)) {
+    return;
+  }
+  BenchResult *result = BenchAddResult(name, entities);
+  if (!result) {
+    return;
+  }
+  result->skipped = 1;
+  snprintf(result->reason, sizeof(result->reason), "%s", reason);
+  printf("%-28s %10zu  skipped: %s\n", name, entities, reason);
+}
+
+void BenchRun(BenchCase *bench) {
+  if (!BenchSelected(bench->name)) {
+    return;
+  }
+
+  static uint64_t samples[MAX_BENCH_TRIALS];
+  double totals[COUNTER_COUNT] = {0};
+  int valid[COUNTER_COUNT];
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    valid[i] = counters.fds[i] >= 0;
+  }
+
+  for (int i = 0; i < suite.warmup + suite.trials; i++) {
+    if (bench->reset) {
+      bench->reset(bench->ctx);
+    }
+    int timed = i >= suite.warmup;
+    if (timed && counters.open) {
+      BenchCountersStart();
+    }
+    uint64_t start = EccNowNs();
+    bench->run(bench->ctx);
+    uint64_t elapsed = EccNowNs() - start;
+    if (timed) {
+      if (counters.open) {
+        BenchCountersStop(totals, valid);
+      }
+      samples[i - suite.warmup] = elapsed;
+    }
+  }
+
+  BenchResult *result = BenchAddResult(bench->name, bench->entities);
+  if (!result) {
+    return;
+  }
+
+  // p99 is nearest rank, with only a handful of trials it is close to the max
+  size_t n = suite.trials;
+  qsort(samples, n, sizeof(samples[0]), CompareNs);
+  result->medianNs = n % 2 ? samples[n / 2]
+                           : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  result->p99Ns = samples[(n * 99 + 99) / 100 - 1];
+  result->minNs = samples[0];
+  result->maxNs = samples[n - 1];
+
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    result->hasCounter[i] = valid[i] && result->entities;
+    if (result->hasCounter[i]) {
+      result->perEntity[i] = totals[i] / ((double)n * result->entities);
+    }
+  }
+
+  printf("%-28s %10zu  median %10.3f ms  p99 %10.3f ms  %8.2f ns/entity",
+         result->name, result->entities, result->medianNs / 1e6,
+         result->p99Ns / 1e6,
+         result->entities ? (double)result->medianNs / result->entities : 0);
+  if (result->hasCounter[COUNTER_CYCLES] &&
+      result->hasCounter[COUNTER_INSTRUCTIONS] &&
+      result->perEntity[COUNTER_CYCLES] > 0) {
+    printf("  %5.2f IPC", result->perEntity[COUNTER_INSTRUCTIONS] /
+                              result->perEntity[COUNTER_CYCLES]);
+  }
+  if (result->hasCounter[COUNTER_LLC_MISSES]) {
+    printf("  %7.3f LLC misses/entity", result->perEntity[COUNTER_LLC_MISSES]);
+  }
+  printf("\n");
+}
+
+int BenchWriteJson(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return 0;
+  }
+
+  fprintf(file,
+          "{\"maxEntities\":%d,\"trials\":%d,\"warmup\":%d,\"cpus\":%ld,",
+          MAX_ENTITIES, suite.trials, suite.warmup,
+          sysconf(_SC_NPROCESSORS_ONLN));
+  if (suite.counters) {
+    fprintf(file, "\"counters\":{\"open\":%d,\"error\":\"%s\"},",
+            counters.open, counters.error);
+  }
+  fprintf(file, "\"results\":[");
+  for (size_t i = 0; i < suite.resultCount; i++) {
+    BenchResult *result = &suite.results[i];
+    fprintf(file, "%s\n{\"name\":\"%s\",\"entities\":%zu,", i ? "," : "",
+            result->name, result->entities);
+    if (result->skipped) {
+      fprintf(file, "\"skipped\":true,\"reason\":\"%s\"}", result->reason);
+      continue;
+    }
+    fprintf(file,
+            "\"medianNs\":%llu,\"p99Ns\":%llu,\"minNs\":%llu,\"maxNs\":%llu,"
+            "\"nsPerEntity\":%.3f",
+            (unsigned long long)result->medianNs,
+            (unsigned long long)result->p99Ns,
+            (unsigned long long)result->minNs,
+            (unsigned long long)result->maxNs,
+            result->entities ? (double)result->medianNs / result->entities
+                             : 0.0);
+
+    // only the counters that were measured, all per entity
+    int measured = 0;
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+      if (result->hasCounter[c]) {
+        fprintf(file, "%s\"%s\":%.4f", measured ? "," : ",\"perEntity\":{",
+                counterNames[c], result->perEntity[c]);
+        measured = 1;
+      }
+    }
+    fprintf(file, measured ? "}}" : "}");
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return 1;
+}
+
+// Buckets
+// ---------------------------------------------------------------------------------------------------
+
+// Everything a case needs, one bucket per entity count
+typedef struct {
+  Arena *arena;
+  Bucket *bucket;
+  size_t n;
+  size_t mark;  // Arena top to roll back to between trials
+  size_t queryCount; // Registered queries to keep when rolling back
+  int componentCount;
+  ComponentType *types[8];
+  Query *queries[8]; // queries[k - 1] matches the first k component types
+  QueryTerms terms;
+  uint32_t *out; // Room for the matches of an ad hoc query
+} BenchBucket;
+
+// Storage every bucket has regardless of how many entities are used, plus
+// room for the component arrays and registered queries the cases make
+size_t BenchBucketBaseBytes() {
+  return sizeof(Bucket) + MAX_COMPONENT_TYPES * sizeof(ComponentType) +
+         (size_t)MAX_ENTITIES * (sizeof(Entity) + 16) +
+         (size_t)MAX_ENTITIES * 16 * 8 + (size_t)MAX_ENTITIES * 8 * 32;
+}
+
+size_t AvailableMemory() {
+  return (size_t)sysconf(_SC_AVPHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Whether a group of cases sharing a bucket of n entities should run. Groups
+// that are filtered out are left alone, groups too big for the build or the
+// machine have each of their cases recorded as skipped. `bytes` is what the
+// cases need on top of BenchBucketBaseBytes
+int BenchGroupRuns(const char **names, size_t nameCount, size_t n,
+                   size_t bytes) {
+  int selected = 0;
+  for (size_t i = 0; i < nameCount; i++) {
+    selected |= BenchSelected(names[i]);
+  }
+  if (!selected) {
+    return 0;
+  }
+
+  char reason[128] = {0};
+  bytes += BenchBucketBaseBytes();
+  if (n > MAX_ENTITIES) {
+    snprintf(reason, sizeof(reason), "more than MAX_ENTITIES (%d)",
+             MAX_ENTITIES);
+  } else if (bytes > AvailableMemory()) {
+    snprintf(reason, sizeof(reason), "needs %zu MB, %zu MB available",
+             bytes >> 20, AvailableMemory() >> 20);
+  }
+  if (!reason[0]) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < nameCount; i++) {
+    BenchSkip(names[i], n, reason);
+  }
+  return 0;
+}
+
+int BenchBucketCreate(BenchBucket *b, size_t n, size_t bytes) {
+  memset(b, 0, sizeof(*b));
+  b->n = n;
+  b->arena = ArenaCreate(BenchBucketBaseBytes() + bytes);
+  if (!b->arena) {
+    return 0;
+  }
+  b->bucket = BucketCreate(b->arena, n);
+  if (!b->bucket) {
+    ArenaDestroy(b->arena);
+    return 0;
+  }
+
+  Bucket *bucket = b->bucket;
+  COMPONENT_MASK(bucket, C1, C2, C3, C4, C5, C6, C7, C8);
+  size_t ids[] = {COMPONENT_ID(C1), COMPONENT_ID(C2), COMPONENT_ID(C3),
+                  COMPONENT_ID(C4), COMPONENT_ID(C5), COMPONENT_ID(C6),
+                  COMPONENT_ID(C7), COMPONENT_ID(C8)};
+  for (int i = 0; i < 8; i++) {
+    b->types[i] = BucketComponentTypeForComponentId(bucket, ids[i]);
+  }
+  return 1;
+}
+
+void BenchBucketDestroy(BenchBucket *b) {
+  free(b->out);
+  ArenaDestroy(b->arena);
+}
+
+// Forget every entity so the next trial starts from an empty bucket again.
+// Indexes aren't reused so this is the only way to run the same bucket twice
+void BenchBucketRewind(BenchBucket *b) {
+  for (size_t i = 0; i < b->bucket->entityListEnd; i++) {
+    if (b->bucket->entities[i]->mask) {
+      BucketDeleteEntity(b->bucket, i);
+    }
+  }
+  b->bucket->entityListEnd = 0;
+  b->bucket->entityCount = 0;
+  b->arena->top = b->mark;
+}
+
+// Cases
+// ---------------------------------------------------------------------------------------------------
+
+void RunBucketCreate(void *ctx) {
+  Arena *arena = ctx;
+  ArenaClear(arena);
+  if (!BucketCreate(arena, MAX_ENTITIES)) {
+    fprintf(stderr, "Failed to create bucket\n");
+  }
+}
+
+void BenchBucketCreation() {
+  const char *name = "bucket_create";
+  if (!BenchGroupRuns(&name, 1, MAX_ENTITIES, 0)) {
+    return;
+  }
+  Arena *arena = ArenaCreate(BenchBucketBaseBytes());
+  if (!arena) {
+    BenchSkip(name, MAX_ENTITIES, "arena allocation failed");
+    return;
+  }
+  BenchCase bench = {name, MAX_ENTITIES, RunBucketCreate, NULL, arena};
+  BenchRun(&bench);
+  ArenaDestroy(arena);
+}
+
+void RewindBucket(void *ctx) { BenchBucketRewind(ctx); }
+
+void RunCreateDestroy(void *ctx) {
+  BenchBucket *b = ctx;
+  Bucket *bucket = b->bucket;
+  for (size_t i = 0; i < b->n; i++) {
+    ADD_COMPONENT_TO_ENTITY(bucket, BucketCreateEntity(bucket), C1);
+  }
+  for (size_t i = 0; i < b->n; i++) {
+    BucketDeleteEntity(bucket, i);
+  }
+}
+
+void BenchCreateDestroy(size_t n) {
+  const char *name = "entity_create_destroy";
+  BenchBucket b;
+  if (!BenchGroupRuns(&name, 1, n, n * 64) ||
+      !BenchBucketCreate(&b, n, n * 64)) {
+    return;
+  }
+  b.mark = b.arena->top;
+  BenchCase bench = {name, n, RunCreateDestroy, RewindBucket, &b};
+  BenchRun(&bench);
+  BenchBucketDestroy(&b);
+}
+
+void RewindChurn(void *ctx) {
+  BenchBucket *b = ctx;
+  b->arena->top = b->mark;
+}
+
+void RunChurn(void *ctx) {
+  BenchBucket *b = ctx;
+  Bucket *bucket = b->bucket;
+  for (size_t i = 0; i < b->n; i++) {
+    Entity *entity = bucket->entities[i];
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C2)->value[0] = 1;
+    REMOVE_COMPONENT_FROM_ENTITY(bucket, entity, C2);
+  }
+}
+
+void BenchChurn(size_t n) {
+  const char *name = "component_churn";
+  BenchBucket b;
+  if (!BenchGroupRuns(&name, 1, n, n * 96) ||
+      !BenchBucketCreate(&b, n, n * 96)) {
+    return;
+  }
+  Bucket *bucket = b.bucket;
+  for (size_t i = 0; i < n; i++) {
+    ADD_COMPONENT_TO_ENTITY(bucket, BucketCreateEntity(bucket), C1);
+  }
+  // a system watching the churned component keeps its query up to date
+  REGISTER_QUERY(bucket, C1, C2);
+  b.mark = b.arena->top;
+
+  BenchCase bench = {name, n, RunChurn, RewindChurn, &b};
+  BenchRun(&bench);
+  BenchBucketDestroy(&b);
+}
+
+// Add the first component to every payload of the others, the shape of a
+// typical update system
+void RunIterate(void *ctx) {
+  BenchBucket *b = ctx;
+  int k = b->componentCount;
+  QuerySpanIterator it =
+      QueryIterateSpans(b->bucket, b->queries[k - 1], b->types, k);
+
+  float total = 0;
+  QuerySpan span;
+  while (QuerySpanNext(&it, &span)) {
+    for (size_t j = 0; j < span.count; j++) {
+      C1 *first = SPAN_COMPONENT(span, 0, C1, j);
+      float sum = 0;
+      for (int t = 1; t < k; t++) {
+        sum += ((C1 *)((char *)span.components[t] + j * span.strides[t]))
+                   ->value[0];
+      }
+      first->value[0] += sum;
+      total += first->value[0];
+    }
+  }
+  benchSink = total;
+}
+
+void BenchIterate(size_t n) {
+  static const char *names[] = {
+      "iterate_1_components", "iterate_2_components", "iterate_3_components",
+      "iterate_4_components", "iterate_5_components", "iterate_6_components",
+      "iterate_7_components", "iterate_8_components"};
+  BenchBucket b;
+  if (!BenchGroupRuns(names, 8, n, n * 320) ||
+      !BenchBucketCreate(&b, n, n * 320)) {
+    return;
+  }
+
+  Bucket *bucket = b.bucket;
+  for (size_t i = 0; i < n; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C1);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C2);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C3);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C4);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C5);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C6);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C7);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C8)->value[0] = 1;
+  }
+
+  BitMask mask = 0;
+  for (int k = 1; k <= 8; k++) {
+    mask |= b.types[k - 1]->mask;
+    b.queries[k - 1] = BucketRegisterQuery(bucket, mask);
+
+    b.componentCount = k;
+    BenchCase bench = {names[k - 1], n, RunIterate, NULL, &b};
+    BenchRun(&bench);
+  }
+  BenchBucketDestroy(&b);
+}
+
+// Components added in a random order with other allocations between them, as
+// they would be after a long run of churn, then the same after compacting
+void BenchFragmented(size_t n) {
+  static const char *names[] = {"iterate_fragmented", "iterate_compacted"};
+  BenchBucket b;
+  if (!BenchGroupRuns(names, 2, n, n * 320) ||
+      !BenchBucketCreate(&b, n, n * 320)) {
+    return;
+  }
+
+  Bucket *bucket = b.bucket;
+  uint32_t *order = malloc(n * sizeof(uint32_t));
+  if (!order) {
+    BenchBucketDestroy(&b);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    BucketCreateEntity(bucket);
+    order[i] = i;
+  }
+  srand(1);
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = (size_t)rand() % (i + 1);
+    uint32_t swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+  for (size_t i = 0; i < n; i++) {
+    Entity *entity = bucket->entities[order[i]];
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C1);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C2)->value[0] = 1;
+    ArenaAllocate(b.arena, 16 + rand() % 112);
+  }
+  free(order);
+
+  b.componentCount = 2;
+  b.queries[1] = REGISTER_QUERY(bucket, C1, C2);
+  BenchCase bench = {names[0], n, RunIterate, NULL, &b};
+  BenchRun(&bench);
+
+  while (!BucketCompact(bucket, 0)) {
+  }
+  bench.name = names[1];
+  BenchRun(&bench);
+
+  BenchBucketDestroy(&b);
+}
+
+void RunRegisterQuery(void *ctx) {
+  BenchBucket *b = ctx;
+  if (!BucketRegisterQueryWithTerms(b->bucket, b->terms)) {
+    fprintf(stderr, "Failed to register query\n");
+    exit(1);
+  }
+}
+
+// Drop the query the last trial registered so every trial registers into the
+// same bucket rather than running into MAX_QUERIES
+void RewindQueries(void *ctx) {
+  BenchBucket *b = ctx;
+  while (b->bucket->queries->length > b->queryCount) {
+    LinkedListPop(b->bucket->queries);
+  }
+  b->arena->top = b->mark;
+}
+
+void RunScanQuery(void *ctx) {
+  BenchBucket *b = ctx;
+  benchSink = BucketScanQuery(b->bucket, b->terms, b->out);
+}
+
+void RunBitsetQuery(void *ctx) {
+  BenchBucket *b = ctx;
+  benchSink = BucketBitsetQuery(b->bucket, b->terms, b->out);
+}
+
+// Every entity has C1, every other one C2 and one in a hundred C3
+void BenchQueryMatching(size_t n) {
+  static const char *names[] = {"query_register", "query_scan",
+                                 "query_bitset", "query_scan_sparse",
+                                 "query_bitset_sparse"};
+  // a registered query has its own arrays sized for every possible entity,
+  // only one is alive at a time
+  size_t bytes = n * 128 + (size_t)MAX_ENTITIES * (2 * sizeof(uint32_t) + 1) +
+                 4096;
+  BenchBucket b;
+  if (!BenchGroupRuns(names, 5, n, bytes) ||
+      !BenchBucketCreate(&b, n, bytes)) {
+    return;
+  }
+
+  Bucket *bucket = b.bucket;
+  for (size_t i = 0; i < n; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, C1);
+    if (i % 2) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, C2);
+    }
+    if (i % 100 == 0) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, C3);
+    }
+  }
+  b.out = malloc((n + MASK_SCAN_SLACK) * sizeof(uint32_t));
+  if (!b.out) {
+    BenchBucketDestroy(&b);
+    return;
+  }
+
+  b.terms = (QueryTerms){.include = COMPONENT_MASK(bucket, C1, C2),
+                         .exclude = COMPONENT_MASK(bucket, C3)};
+  b.mark = b.arena->top;
+  b.queryCount = bucket->queries->length;
+  BenchCase bench = {names[0], n, RunRegisterQuery, RewindQueries, &b};
+  BenchRun(&bench);
+
+  bench.name = names[1];
+  bench.run = RunScanQuery;
+  bench.reset = NULL;
+  BenchRun(&bench);
+
+  bench.name = names[2];
+  bench.run = RunBitsetQuery;
+  BenchRun(&bench);
+
+  b.terms = (QueryTerms){.include = COMPONENT_MASK(bucket, C3)};
+  bench.name = names[3];
+  bench.run = RunScanQuery;
+  BenchRun(&bench);
+
+  bench.name = names[4];
+  bench.run = RunBitsetQuery;
+  BenchRun(&bench);
+
+  BenchBucketDestroy(&b);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--trials") && i + 1 < argc) {
+      suite.trials = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+      suite.warmup = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+      suite.jsonPath = argv[++i];
+    } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+      suite.filter = argv[++i];
+    } else if (!strcmp(argv[i], "--counters")) {
+      suite.counters = 1;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--trials N] [--warmup N] [--json path] "
+              "[--filter substring] [--counters]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (suite.trials < 1 || suite.trials > MAX_BENCH_TRIALS ||
+      suite.warmup < 0) {
+    fprintf(stderr, "Trials must be between 1 and %d\n", MAX_BENCH_TRIALS);
+    return 1;
+  }
+
+  if (suite.counters) {
+    int open = BenchCountersOpen();
+    if (!open) {
+      printf("Hardware counters unavailable (%s), timing only\n",
+             counters.error);
+    } else if (open < COUNTER_COUNT) {
+      printf("Only %d of %d hardware counters available (%s)\n", open,
+             COUNTER_COUNT, counters.error);
+    }
+  }
+
+  BenchBucketCreation();
+  for (size_t i = 0; i < BENCH_SIZE_COUNT; i++) {
+    BenchCreateDestroy(benchSizes[i]);
+  }
+  for (size_t i = 0; i < BENCH_SIZE_COUNT; i++) {
+    BenchChurn(benchSizes[i]);
+  }
+  for (size_t i = 0; i < BENCH_SIZE_COUNT; i++) {
+    BenchIterate(benchSizes[i]);
+  }
+  for (size_t i = 0; i < BENCH_SIZE_COUNT; i++) {
+    BenchFragmented(benchSizes[i]);
+  }
+  for (size_t i = 0; i < BENCH_SIZE_COUNT; i++) {
+    BenchQueryMatching(benchSizes[i]);
+  }
+
+  BenchCountersClose();
+
+  if (!BenchWriteJson(suite.jsonPath)) {
+    fprintf(stderr, "Failed to write %s\n", suite.jsonPath);
+    return 1;
+  }
+  printf("Results written to %s\n", suite.jsonPath);
+  return 0;
+}
@@ -74,6 +74,74 @@ void RunBenchmark(int iterations) {
   ArenaDestroy(arena);
 }
 
+typedef struct {
+  float x, y;
+  float vx, vy;
+} Agent;
+
+#define SCALING_ENTITIES 10000
+#define SCALING_FRAMES 200
+
+// Stand in for an integration/AI system, enough arithmetic per entity that the
+// work rather than the scheduling dominates
+void IntegrateAgents(Bucket *bucket, const uint32_t *entityIndexes,
+                     size_t count, void *userData, int worker) {
+  ComponentType *agentType = userData;
+  for (size_t i = 0; i < count; i++) {
+    Agent *agent = agentType->entries[entityIndexes[i]];
+    for (int step = 0; step < 32; step++) {
+      agent->vx += -agent->x * 0.001f;
+      agent->vy += -agent->y * 0.001f;
+      agent->x += agent->vx * 0.016f;
+      agent->y += agent->vy * 0.016f;
+    }
+  }
+}
+
+// Time the same parallel system on 1 to 32 threads
+void RunParallelScaling() {
+  Arena *arena = ArenaCreate(ARENA_SIZE);
+  if (!arena) {
+    fprintf(stderr, "Failed to create arena\n");
+    return;
+  }
+  Bucket *bucket = BucketCreate(arena, SCALING_ENTITIES);
+
+  for (int i = 0; i < SCALING_ENTITIES; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    Agent *agent = ADD_COMPONENT_TO_ENTITY(bucket, entity, Agent);
+    agent->x = (float)(i % 100);
+    agent->y = (float)(i / 100);
+  }
+  Query *query = REGISTER_QUERY(bucket, Agent);
+  ComponentType *agentType = BucketGetComponentType(bucket, "Agent");
+
+  printf("Parallel scaling (%d entities, %d frames)\n", SCALING_ENTITIES,
+         SCALING_FRAMES);
+
+  double baseline = 0;
+  int threadCounts[] = {1, 2, 4, 8, 16, 32};
+  for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+    JobSystem *jobs = JobSystemCreate(threadCounts[t], 0);
+
+    uint64_t start = EccNowNs();
+    for (int frame = 0; frame < SCALING_FRAMES; frame++) {
+      QueryParallelFor(jobs, bucket, query, 0, IntegrateAgents, agentType);
+    }
+    double elapsed = (double)(EccNowNs() - start) / 1e9;
+
+    JobSystemDestroy(jobs);
+
+    if (t == 0) {
+      baseline = elapsed;
+    }
+    printf("  %2d threads: %.4f seconds (%.2fx)\n", threadCounts[t], elapsed,
+           baseline / elapsed);
+  }
+
+  ArenaDestroy(arena);
+}
+
 int main(int argc, char **argv) {
   int iterations = DEFAULT_ITERATIONS;
 
@@ -82,5 +150,6 @@ int main(int argc, char **argv) {
   }
 
   RunBenchmark(iterations);
+  RunParallelScaling();
   return 0;
 }
@@ -250,6 +250,1764 @@ void TestRemoveComponentTypeFromEntityWithMacro() {
   printf("TestRemoveComponentTypeFromEntityWithMacro        PASSED\n");
 }
 
+void TestSharedComponents() {
+  typedef struct {
+    float x;
+    float y;
+  } Scale;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Entity *a = BucketCreateEntity(bucket);
+  Entity *b = BucketCreateEntity(bucket);
+  Entity *c = BucketCreateEntity(bucket);
+
+  const Scale *scaleA =
+      SET_SHARED_COMPONENT_FOR_ENTITY(bucket, a, Scale, ((Scale){32, 32}));
+  const Scale *scaleB =
+      SET_SHARED_COMPONENT_FOR_ENTITY(bucket, b, Scale, ((Scale){32, 32}));
+  const Scale *scaleC =
+      SET_SHARED_COMPONENT_FOR_ENTITY(bucket, c, Scale, ((Scale){16, 16}));
+
+  ComponentType *scaleType = BucketGetComponentType(bucket, "Scale");
+  int deduplicated = scaleA == scaleB && scaleA != scaleC;
+  size_t valueCount = scaleType->sharedValueCount;
+
+  const Scale *fetched = GET_SHARED_COMPONENT_FROM_ENTITY(bucket, b, Scale);
+  int fetchedShared = fetched == scaleA;
+
+  // the plain getters hand out writable pointers so they must not give away a
+  // value other entities are using
+  void *components[1];
+  int plainRefused = !GET_COMPONENT_FROM_ENTITY(bucket, b, Scale) &&
+                     !GET_COMPONENTS_FROM_ENTITY(bucket, b, components, Scale) &&
+                     !GetComponentForEntity(bucket, b, "Scale");
+
+  // the general mutable getter copies on write just like the shared one
+  Scale *generalB = GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, b, Scale);
+  generalB->y = 4;
+  int generalCopied = generalB != scaleA && scaleA->y == 32 &&
+                      GET_SHARED_COMPONENT_FROM_ENTITY(bucket, a, Scale)->y ==
+                          32 &&
+                      GET_SHARED_COMPONENT_FROM_ENTITY(bucket, b, Scale)->y == 4;
+
+  // writing through the mutable getter must not leak into the other entity
+  Scale *mutableB = GET_MUTABLE_SHARED_COMPONENT_FROM_ENTITY(bucket, b, Scale);
+  mutableB->x = 8;
+  int copiedOnWrite = mutableB != scaleA && scaleA->x == 32;
+
+  // c is the only user of its value so it can be written in place
+  Scale *mutableC = GET_MUTABLE_SHARED_COMPONENT_FROM_ENTITY(bucket, c, Scale);
+  int writtenInPlace = mutableC == scaleC;
+
+  SET_SHARED_COMPONENT_FOR_ENTITY(bucket, b, Scale, ((Scale){32, 32}));
+  SET_SHARED_COMPONENT_FOR_ENTITY(bucket, c, Scale, ((Scale){32, 32}));
+
+  // building a mask registers the type as a plain one first, setting it as
+  // shared afterwards still works while nothing has a plain instance of it
+  typedef struct {
+    uint32_t color;
+  } Tint;
+  typedef short Plain;
+  Query *tinted = REGISTER_QUERY(bucket, Tint);
+  const Tint *tint =
+      SET_SHARED_COMPONENT_FOR_ENTITY(bucket, a, Tint, ((Tint){0xff0000}));
+  ADD_COMPONENT_TO_ENTITY(bucket, a, Plain);
+  int maskFirst =
+      tint && tinted->count == 1 &&
+      GET_SHARED_COMPONENT_FROM_ENTITY(bucket, a, Tint) == tint &&
+      !SET_SHARED_COMPONENT_FOR_ENTITY(bucket, b, Plain, ((Plain){1}));
+
+  size_t indexes[MAX_ENTITIES];
+  SharedComponentGroup groups[8];
+  size_t groupCount = BucketGroupBySharedComponent(bucket, 0, scaleType,
+                                                   indexes, groups);
+  size_t refCount = SharedComponentValueFromData((void *)scaleA)->refCount;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(deduplicated);
+  ASSERT(valueCount == 2);
+  ASSERT(fetchedShared);
+  ASSERT(plainRefused);
+  ASSERT(generalCopied);
+  ASSERT(maskFirst);
+  ASSERT(copiedOnWrite);
+  ASSERT(writtenInPlace);
+  ASSERT(groupCount == 1);
+  ASSERT(groups[0].count == 3 && groups[0].value->data == (char *)scaleA);
+  ASSERT(refCount == 3);
+
+  printf("TestSharedComponents        PASSED\n");
+}
+
+void TestChangeTicks() {
+  typedef struct {
+    float x;
+    float y;
+  } Position;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Entity *a = BucketCreateEntity(bucket);
+  Entity *b = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, a, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, b, Position);
+
+  ComponentType *posType = BucketGetComponentType(bucket, "Position");
+  size_t indexes[MAX_ENTITIES];
+
+  // a system that has never run (tick 0) sees everything as added
+  size_t addedCount =
+      BucketQueryChanged(bucket, 0, posType, COMPONENT_ADDED, 0, indexes);
+
+  uint32_t lastRun = BucketAdvanceTick(bucket);
+  size_t untouchedCount = BucketQueryChanged(bucket, 0, posType,
+                                             COMPONENT_CHANGED, lastRun, indexes);
+
+  // reads don't count as changes, mutable gets do
+  BucketAdvanceTick(bucket);
+  GET_COMPONENT_FROM_ENTITY(bucket, a, Position);
+  Position *pos = GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, b, Position);
+  pos->x = 4;
+
+  size_t changedCount = BucketQueryChanged(bucket, 0, posType,
+                                           COMPONENT_CHANGED, lastRun, indexes);
+  int changedWasB = indexes[0] == b->index;
+  size_t newlyAddedCount =
+      BucketQueryChanged(bucket, 0, posType, COMPONENT_ADDED, lastRun, indexes);
+
+  ArenaDestroy(testArena);
+
+  ASSERT(addedCount == 2);
+  ASSERT(untouchedCount == 0);
+  ASSERT(changedCount == 1 && changedWasB);
+  ASSERT(newlyAddedCount == 0);
+
+  printf("TestChangeTicks        PASSED\n");
+}
+
+void TestEnableDisableComponent() {
+  typedef struct {
+    int state;
+  } Behaviour;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Entity *a = BucketCreateEntity(bucket);
+  Entity *b = BucketCreateEntity(bucket);
+  Behaviour *behaviour = ADD_COMPONENT_TO_ENTITY(bucket, a, Behaviour);
+  behaviour->state = 7;
+  ADD_COMPONENT_TO_ENTITY(bucket, b, Behaviour);
+
+  ComponentType *behaviourType = BucketGetComponentType(bucket, "Behaviour");
+  size_t indexes[MAX_ENTITIES];
+  size_t arenaTop = testArena->top;
+
+  for (int i = 0; i < 1000; i++) {
+    DISABLE_COMPONENT_FOR_ENTITY(bucket, a, Behaviour);
+    ENABLE_COMPONENT_FOR_ENTITY(bucket, a, Behaviour);
+  }
+  DISABLE_COMPONENT_FOR_ENTITY(bucket, a, Behaviour);
+
+  int toggledWithoutAllocating = testArena->top == arenaTop;
+  int enabled = IsComponentEnabledForEntityById(bucket, a->index, behaviourType);
+  size_t matchCount = BucketQueryChanged(bucket, 0, behaviourType,
+                                         COMPONENT_ADDED, 0, indexes);
+  int onlyB = indexes[0] == b->index;
+
+  Behaviour *kept = GET_COMPONENT_FROM_ENTITY(bucket, a, Behaviour);
+  int dataKept = kept == behaviour && kept->state == 7;
+
+  ENABLE_COMPONENT_FOR_ENTITY(bucket, a, Behaviour);
+  size_t reenabledCount = BucketQueryChanged(bucket, 0, behaviourType,
+                                             COMPONENT_ADDED, 0, indexes);
+
+  ArenaDestroy(testArena);
+
+  ASSERT(toggledWithoutAllocating);
+  ASSERT(!enabled);
+  ASSERT(matchCount == 1 && onlyB);
+  ASSERT(dataKept);
+  ASSERT(reenabledCount == 2);
+
+  printf("TestEnableDisableComponent        PASSED\n");
+}
+
+int relocatedCount = 0;
+
+void CountRelocation(ComponentType *componentType, size_t entityId, void *from,
+                     void *to, void *userData) {
+  relocatedCount++;
+}
+
+void TestCompaction() {
+  typedef struct {
+    float x;
+    float y;
+  } Position;
+
+  typedef struct {
+    float x;
+    float y;
+  } Velocity;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+  BucketSetRelocationCallback(bucket, CountRelocation, NULL);
+
+  // interleave the two types so neither is contiguous
+  for (int i = 0; i < 100; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    Position *pos = ADD_COMPONENT_TO_ENTITY(bucket, entity, Position);
+    pos->x = i;
+    Velocity *vel = ADD_COMPONENT_TO_ENTITY(bucket, entity, Velocity);
+    vel->x = -i;
+  }
+  for (int i = 0; i < 100; i += 3) {
+    REMOVE_COMPONENT_FROM_ENTITY(bucket, bucket->entities[i], Position);
+  }
+
+  // a tiny budget has to get there eventually over several calls
+  int calls = 1;
+  while (!BucketCompact(bucket, 1)) {
+    calls++;
+  }
+
+  ComponentType *posType = BucketGetComponentType(bucket, "Position");
+  int contiguous = 1;
+  int valuesKept = 1;
+  char *last = NULL;
+  for (int i = 0; i < 100; i++) {
+    Position *pos = GET_COMPONENT_FROM_ENTITY(bucket, bucket->entities[i],
+                                              Position);
+    Velocity *vel = GET_COMPONENT_FROM_ENTITY(bucket, bucket->entities[i],
+                                              Velocity);
+    valuesKept &= vel && vel->x == -i;
+    if (i % 3 == 0) {
+      valuesKept &= pos == NULL;
+      continue;
+    }
+    valuesKept &= pos && pos->x == i;
+    if (last) {
+      contiguous &= (char *)pos == last + posType->componentSize;
+    }
+    last = (char *)pos;
+  }
+
+  int movedFirstPass = relocatedCount;
+
+  // already compact so nothing should move this time
+  BucketCompact(bucket, 0);
+  int movedSecondPass = relocatedCount - movedFirstPass;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(calls > 1);
+  ASSERT(valuesKept);
+  ASSERT(contiguous);
+  ASSERT(movedFirstPass == 166);
+  ASSERT(movedSecondPass == 0);
+
+  printf("TestCompaction        PASSED\n");
+}
+
+void TestComponentIdsAcrossBuckets() {
+  typedef struct {
+    float x;
+  } Health;
+
+  typedef struct {
+    float y;
+  } Armour;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE * 2);
+
+  // register the same types in a different order so their per bucket ids
+  // differ, the cached ids have to resolve correctly in both
+  Bucket *first = BucketCreate(testArena, 10);
+  Bucket *second = BucketCreate(testArena, 10);
+
+  Entity *a = BucketCreateEntity(first);
+  ADD_COMPONENT_TO_ENTITY(first, a, Health)->x = 1;
+  ADD_COMPONENT_TO_ENTITY(first, a, Armour)->y = 2;
+
+  Entity *b = BucketCreateEntity(second);
+  ADD_COMPONENT_TO_ENTITY(second, b, Armour)->y = 3;
+  ADD_COMPONENT_TO_ENTITY(second, b, Health)->x = 4;
+
+  int resolved = 1;
+  for (int i = 0; i < 2; i++) {
+    resolved &= GET_COMPONENT_FROM_ENTITY(first, a, Health)->x == 1;
+    resolved &= GET_COMPONENT_FROM_ENTITY(first, a, Armour)->y == 2;
+    resolved &= GET_COMPONENT_FROM_ENTITY(second, b, Armour)->y == 3;
+    resolved &= GET_COMPONENT_FROM_ENTITY(second, b, Health)->x == 4;
+  }
+
+  int sameId = COMPONENT_ID(Health) == EccComponentIdForName("Health");
+  int mapped = BucketComponentTypeForComponentId(first, COMPONENT_ID(Health)) ==
+               BucketGetComponentType(first, "Health");
+
+  ArenaDestroy(testArena);
+
+  ASSERT(resolved);
+  ASSERT(sameId);
+  ASSERT(mapped);
+
+  printf("TestComponentIdsAcrossBuckets        PASSED\n");
+}
+
+void TestComponentNameLookup() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE * 2);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  // names coming from data are usually in temporary buffers
+  char names[40][16];
+  for (int i = 0; i < 40; i++) {
+    snprintf(names[i], sizeof(names[i]), "Component%d", i);
+    BucketRegisterComponentType(bucket, sizeof(int), names[i]);
+  }
+
+  char lookup[16];
+  snprintf(lookup, sizeof(lookup), "Component%d", 37);
+  ComponentType *found = BucketGetComponentType(bucket, lookup);
+  int foundId = found ? (int)found->componentId : -1;
+
+  char *interned = BucketInternComponentName(bucket, lookup);
+  int internedIsOwnCopy = interned != lookup && interned == found->name;
+  int foundByInterned = BucketGetComponentType(bucket, interned) == found;
+  int missing = BucketGetComponentType(bucket, "NotAComponent") == NULL;
+
+  // masks past bit 31 need to be built from a 64 bit one
+  int highMask = found->mask == (BitMask)1 << 37;
+
+  Entity *entity = BucketCreateEntity(bucket);
+  int *value = AddComponentToEntity(bucket, entity, sizeof(int), interned);
+  *value = 5;
+  int *fetched = GetComponentForEntity(bucket, entity, lookup);
+  int fetchedValue = fetched ? *fetched : -1;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(foundId == 37);
+  ASSERT(internedIsOwnCopy);
+  ASSERT(foundByInterned);
+  ASSERT(missing);
+  ASSERT(highMask);
+  ASSERT(fetchedValue == 5);
+
+  printf("TestComponentNameLookup        PASSED\n");
+}
+
+void TestGetMultipleComponents() {
+  typedef struct {
+    float x;
+    float y;
+  } Position;
+
+  typedef float Speed;
+
+  typedef struct {
+    float x;
+    float y;
+  } Direction;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Entity *full = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, full, Position)->x = 1;
+  *ADD_COMPONENT_TO_ENTITY(bucket, full, Speed) = 2;
+  ADD_COMPONENT_TO_ENTITY(bucket, full, Direction)->y = 3;
+
+  Entity *partial = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, partial, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, partial, Direction);
+
+  void *components[3];
+  int fullFound = GET_COMPONENTS_FROM_ENTITY(bucket, full, components,
+                                             Position, Speed, Direction);
+  int fullValues = fullFound && ((Position *)components[0])->x == 1 &&
+                   *(Speed *)components[1] == 2 &&
+                   ((Direction *)components[2])->y == 3;
+
+  int partialFound = GET_COMPONENTS_FROM_ENTITY(bucket, partial, components,
+                                                Position, Speed, Direction);
+  int partialCleared = components[0] == NULL && components[2] == NULL;
+
+  // only the types listed first as written are stamped as changed
+  BucketAdvanceTick(bucket);
+  uint32_t tick = bucket->tick;
+  int mutableFound = GET_MUTABLE_COMPONENTS_FROM_ENTITY(
+      bucket, full, components, 1, Position, Speed, Direction);
+  ComponentType *positionType = BucketGetComponentType(bucket, "Position");
+  ComponentType *speedType = BucketGetComponentType(bucket, "Speed");
+  int writesStamped = mutableFound && components[1] != NULL &&
+                      positionType->changedTicks[full->index] == tick &&
+                      speedType->changedTicks[full->index] != tick;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(fullValues);
+  ASSERT(!partialFound);
+  ASSERT(partialCleared);
+  ASSERT(writesStamped);
+
+  printf("TestGetMultipleComponents        PASSED\n");
+}
+
+void TestRegisteredQuery() {
+  typedef struct {
+    float x;
+    float y;
+  } Position;
+
+  typedef struct {
+    float x;
+    float y;
+  } Velocity;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Entity *before = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, before, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, before, Velocity);
+
+  // existing matches are picked up when the query is registered
+  Query *query = REGISTER_QUERY(bucket, Position, Velocity);
+  size_t initialCount = query->count;
+
+  Entity *after = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, after, Position);
+  size_t partialCount = query->count;
+  ADD_COMPONENT_TO_ENTITY(bucket, after, Velocity);
+  size_t addedCount = query->count;
+
+  Entity *other = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, other, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, other, Velocity);
+
+  REMOVE_COMPONENT_FROM_ENTITY(bucket, before, Velocity);
+  size_t removedCount = query->count;
+
+  BucketDeleteEntity(bucket, after->index);
+  size_t deletedCount = query->count;
+  int remainingIsOther = query->matches[0] == other->index;
+
+  // disabled components keep the entity in the query but iteration skips it
+  DISABLE_COMPONENT_FOR_ENTITY(bucket, other, Velocity);
+  size_t disabledCount = query->count;
+  int skipped = QueryGetEntity(bucket, query, 0) == NULL;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(initialCount == 1);
+  ASSERT(partialCount == 1);
+  ASSERT(addedCount == 2);
+  ASSERT(removedCount == 2);
+  ASSERT(deletedCount == 1 && remainingIsOther);
+  ASSERT(disabledCount == 1 && skipped);
+
+  printf("TestRegisteredQuery        PASSED\n");
+}
+
+void TestQuerySpans() {
+  typedef struct {
+    float x;
+    float y;
+  } Position;
+
+  typedef struct {
+    float x;
+    float y;
+  } Velocity;
+
+  typedef struct {
+    float size;
+  } Scale;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  Query *query = REGISTER_QUERY(bucket, Position, Velocity);
+
+  for (int i = 0; i < 64; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, Position)->x = i;
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, Velocity)->x = 1;
+    SET_SHARED_COMPONENT_FOR_ENTITY(bucket, entity, Scale, ((Scale){2}));
+  }
+
+  // interleaved allocations can't be strided so every span is one entity
+  QuerySpanIterator it =
+      QUERY_ITERATE_SPANS(bucket, query, Position, Velocity, Scale);
+  QuerySpan span;
+  size_t scatteredSpans = 0;
+  while (QuerySpanNext(&it, &span)) {
+    scatteredSpans++;
+  }
+
+  BucketCompact(bucket, 0);
+
+  size_t compactSpans = 0;
+  size_t visited = 0;
+  int sharedStride = 1;
+  it = QUERY_ITERATE_SPANS(bucket, query, Position, Velocity, Scale);
+  while (QuerySpanNext(&it, &span)) {
+    compactSpans++;
+    sharedStride &= span.count == 1 || span.strides[2] == 0;
+    for (size_t k = 0; k < span.count; k++) {
+      Position *position = SPAN_COMPONENT(span, 0, Position, k);
+      Velocity *velocity = SPAN_COMPONENT(span, 1, Velocity, k);
+      Scale *scale = SPAN_COMPONENT(span, 2, Scale, k);
+      position->x += velocity->x * scale->size;
+      visited++;
+    }
+  }
+
+  int moved = 1;
+  for (int i = 0; i < 64; i++) {
+    Position *position =
+        GET_COMPONENT_FROM_ENTITY(bucket, bucket->entities[i], Position);
+    moved &= position->x == i + 2;
+  }
+
+  ArenaDestroy(testArena);
+
+  ASSERT(scatteredSpans == 64);
+  ASSERT(compactSpans == 1);
+  ASSERT(sharedStride);
+  ASSERT(visited == 64);
+  ASSERT(moved);
+
+  printf("TestQuerySpans        PASSED\n");
+}
+
+// Number of a registered query's matches that are usable right now
+size_t CountQueryEntities(Bucket *bucket, Query *query) {
+  size_t count = 0;
+  for (size_t i = 0; i < query->count; i++) {
+    count += QueryGetEntity(bucket, query, i) != NULL;
+  }
+  return count;
+}
+
+void TestQueryTerms() {
+  typedef struct {
+    float x;
+  } Position;
+
+  typedef struct {
+    float x;
+  } Velocity;
+
+  typedef short Frozen;
+  typedef short Player;
+  typedef short Enemy;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Query *query = REGISTER_QUERY_WITH_TERMS(
+      bucket, .include = COMPONENT_MASK(bucket, Position),
+      .exclude = COMPONENT_MASK(bucket, Frozen),
+      .any = COMPONENT_MASK(bucket, Player, Enemy),
+      .optional = COMPONENT_MASK(bucket, Velocity));
+
+  Entity *player = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, player, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, player, Player);
+  ADD_COMPONENT_TO_ENTITY(bucket, player, Velocity)->x = 3;
+
+  Entity *enemy = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, enemy, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, enemy, Enemy);
+
+  Entity *frozenEnemy = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenEnemy, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenEnemy, Enemy);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenEnemy, Frozen);
+
+  Entity *bystander = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, bystander, Position);
+
+  size_t matchCount = CountQueryEntities(bucket, query);
+
+  size_t withVelocity = 0;
+  size_t withoutVelocity = 0;
+  QuerySpanIterator it = QUERY_ITERATE_SPANS(bucket, query, Position, Velocity);
+  QuerySpan span;
+  while (QuerySpanNext(&it, &span)) {
+    for (size_t k = 0; k < span.count; k++) {
+      Velocity *velocity = span.components[1]
+                               ? SPAN_COMPONENT(span, 1, Velocity, k)
+                               : NULL;
+      if (velocity && velocity->x == 3) {
+        withVelocity++;
+      } else if (!velocity) {
+        withoutVelocity++;
+      }
+    }
+  }
+
+  // thawing the enemy brings it into the query
+  REMOVE_COMPONENT_FROM_ENTITY(bucket, frozenEnemy, Frozen);
+  size_t thawedCount = CountQueryEntities(bucket, query);
+
+  // a disabled component counts as missing for exclude too, whichever way the
+  // terms are answered
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenEnemy, Frozen);
+  DISABLE_COMPONENT_FOR_ENTITY(bucket, frozenEnemy, Frozen);
+  Entity *frozenPlayer = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenPlayer, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenPlayer, Player);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozenPlayer, Frozen);
+
+  QueryTerms terms = {.include = query->include,
+                      .exclude = query->exclude,
+                      .any = query->any};
+  uint32_t scanned[MAX_ENTITIES + MASK_SCAN_SLACK];
+  uint32_t bitset[MAX_ENTITIES];
+  size_t registeredCount = CountQueryEntities(bucket, query);
+  size_t scanCount = BucketScanQuery(bucket, terms, scanned);
+  size_t bitsetCount = BucketBitsetQuery(bucket, terms, bitset);
+  int pathsAgree =
+      registeredCount == 3 && scanCount == 3 && bitsetCount == 3 &&
+      memcmp(scanned, bitset, sizeof(uint32_t) * 3) == 0 &&
+      scanned[2] == frozenEnemy->index &&
+      QueryGetEntity(bucket, query, query->slots[frozenEnemy->index] - 1) ==
+          frozenEnemy &&
+      !QueryGetEntity(bucket, query, query->slots[frozenPlayer->index] - 1);
+
+  // exclude only terms would match dead and unused slots, so they're refused
+  QueryTerms notFrozen = {.exclude = COMPONENT_MASK(bucket, Frozen)};
+  Query *excludeOnly = BucketRegisterQueryWithTerms(bucket, notFrozen);
+  Entity *fresh = BucketCreateEntity(bucket);
+  BucketDeleteEntity(bucket, fresh->index);
+  BucketCreateEntity(bucket);
+  size_t excludeOnlyScanned = BucketScanQuery(bucket, notFrozen, scanned);
+
+  ArenaDestroy(testArena);
+
+  ASSERT(matchCount == 2);
+  ASSERT(withVelocity == 1);
+  ASSERT(withoutVelocity == 1);
+  ASSERT(thawedCount == 3);
+  ASSERT(pathsAgree);
+  ASSERT(excludeOnly == NULL);
+  ASSERT(excludeOnlyScanned == 0);
+
+  printf("TestQueryTerms        PASSED\n");
+}
+
+void TestMaskScan() {
+  typedef struct {
+    float x;
+  } Position;
+
+  typedef short Frozen;
+
+  const size_t count = 1003; // not a multiple of any vector width
+  BitMask *masks = malloc(sizeof(BitMask) * count);
+  uint32_t *expected = malloc(sizeof(uint32_t) * (count + MASK_SCAN_SLACK));
+  uint32_t *found = malloc(sizeof(uint32_t) * (count + MASK_SCAN_SLACK));
+
+  srand(1);
+  for (size_t i = 0; i < count; i++) {
+    masks[i] = (BitMask)rand() & 0xff;
+    masks[i] |= (BitMask)(rand() & 1) << 63;
+  }
+
+  BitMask include = 0x5 | (BitMask)1 << 63;
+  BitMask exclude = 0x20;
+
+  size_t expectedCount = 0;
+  for (size_t i = 0; i < count; i++) {
+    if ((masks[i] & include) == include && !(masks[i] & exclude)) {
+      expected[expectedCount++] = i;
+    }
+  }
+
+  MaskScanFn kernels[] = {
+      MaskScanScalar,
+#if defined(__x86_64__)
+      MaskScanSSE2,
+      __builtin_cpu_supports("avx2") ? MaskScanAVX2 : MaskScanSSE2,
+#endif
+      MaskScan,
+  };
+
+  int kernelsAgree = 1;
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    size_t foundCount = kernels[k](masks, count, include, exclude, found);
+    kernelsAgree &= foundCount == expectedCount &&
+                    memcmp(found, expected, foundCount * sizeof(uint32_t)) == 0;
+  }
+
+  free(masks);
+  free(expected);
+  free(found);
+
+  // ad-hoc scans over a bucket see disabled components as missing
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 10);
+
+  Entity *moving = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, moving, Position);
+  Entity *frozen = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozen, Position);
+  ADD_COMPONENT_TO_ENTITY(bucket, frozen, Frozen);
+  Entity *disabled = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, disabled, Position);
+  DISABLE_COMPONENT_FOR_ENTITY(bucket, disabled, Position);
+
+  uint32_t indexes[MAX_ENTITIES + MASK_SCAN_SLACK];
+  size_t scanCount = BucketScanQuery(
+      bucket,
+      (QueryTerms){.include = COMPONENT_MASK(bucket, Position),
+                   .exclude = COMPONENT_MASK(bucket, Frozen)},
+      indexes);
+  int onlyMoving = indexes[0] == moving->index;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(kernelsAgree);
+  ASSERT(scanCount == 1 && onlyMoving);
+
+  printf("TestMaskScan        PASSED\n");
+}
+
+void TestBitsetQuery() {
+  typedef short Sparse;
+  typedef short Common;
+  typedef short Excluded;
+
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 9000);
+
+  for (int i = 0; i < 9000; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    if (i % 997 == 0) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, Sparse);
+    }
+    if (i % 2 == 0) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, Common);
+    }
+    if (i % 3 == 0) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, Excluded);
+    }
+  }
+
+  DISABLE_COMPONENT_FOR_ENTITY(bucket, bucket->entities[1994], Sparse);
+  REMOVE_COMPONENT_FROM_ENTITY(bucket, bucket->entities[3988], Sparse);
+
+  QueryTerms terms = {.include = COMPONENT_MASK(bucket, Sparse, Common),
+                      .exclude = COMPONENT_MASK(bucket, Excluded)};
+
+  uint32_t *scanned = malloc(sizeof(uint32_t) * (9000 + MASK_SCAN_SLACK));
+  uint32_t *bitset = malloc(sizeof(uint32_t) * 9000);
+  size_t scannedCount = BucketScanQuery(bucket, terms, scanned);
+  size_t bitsetCount = BucketBitsetQuery(bucket, terms, bitset);
+  int same = scannedCount == bitsetCount &&
+             memcmp(scanned, bitset, sizeof(uint32_t) * bitsetCount) == 0;
+
+  free(scanned);
+  free(bitset);
+  ArenaDestroy(testArena);
+
+  // 0, 1994, 3988, 5982 and 7976 are even multiples of 997. 0 and 5982 are
+  // excluded, 1994 is disabled and 3988 was removed
+  ASSERT(bitsetCount == 1);
+  ASSERT(same);
+
+  printf("TestBitsetQuery        PASSED\n");
+}
+
+typedef struct {
+  uint32_t color;
+} Material;
+
+int sortKeyCalls = 0;
+
+uint32_t MaterialKey(const void *component, void *userData) {
+  sortKeyCalls++;
+  return ((const Material *)component)->color;
+}
+
+int sortCompareCalls = 0;
+
+int CompareMaterialDescending(Bucket *bucket, uint32_t a, uint32_t b,
+                              void *userData) {
+  sortCompareCalls++;
+  ComponentType *materialType = userData;
+  uint32_t colorA = ((Material *)materialType->entries[a])->color;
+  uint32_t colorB = ((Material *)materialType->entries[b])->color;
+  return (colorA < colorB) - (colorA > colorB);
+}
+
+void TestSortedQuery() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  Query *query = REGISTER_QUERY(bucket, Material);
+  ComponentType *materialType = BucketGetComponentType(bucket, "Material");
+
+  uint32_t colors[] = {0xff0000, 0x00ff00, 0x0000ff, 0xff000000};
+  for (int i = 0; i < 40; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, Material)->color =
+        colors[(i * 7) % 4];
+  }
+
+  BucketAdvanceTick(bucket);
+  size_t groupCount =
+      QuerySortByKey(bucket, query, materialType, MaterialKey, NULL);
+
+  int ordered = 1;
+  for (size_t g = 0; g < groupCount; g++) {
+    QueryGroup *group = &query->groups[g];
+    for (size_t i = group->start; i < group->start + group->count; i++) {
+      Material *material = materialType->entries[query->matches[i]];
+      ordered &= material->color == group->key;
+    }
+    ordered &= g == 0 || query->groups[g - 1].key < group->key;
+    ordered &= group->count == 10;
+  }
+
+  // slots have to follow the new order for removal to keep working
+  int slotsFollow = 1;
+  for (size_t i = 0; i < query->count; i++) {
+    slotsFollow &= query->slots[query->matches[i]] == i + 1;
+  }
+
+  // nothing changed so the cached order is reused
+  BucketAdvanceTick(bucket);
+  uint32_t *first = &query->matches[0];
+  uint32_t firstEntity = *first;
+  sortKeyCalls = 0;
+  QuerySortByKey(bucket, query, materialType, MaterialKey, NULL);
+  int reused = sortKeyCalls == 0 && *first == firstEntity;
+
+  // changing a key through a mutable get forces a re-sort
+  Material *material = GET_MUTABLE_COMPONENT_FROM_ENTITY(
+      bucket, bucket->entities[query->matches[0]], Material);
+  material->color = 0xffffffff;
+  BucketAdvanceTick(bucket);
+  QuerySortByKey(bucket, query, materialType, MaterialKey, NULL);
+  int resorted = query->matches[query->count - 1] == firstEntity;
+
+  // so does a second change within the same tick as the last sort
+  uint32_t secondEntity = query->matches[0];
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, bucket->entities[secondEntity],
+                                    Material)
+      ->color = 0xffffffff;
+  QuerySortByKey(bucket, query, materialType, MaterialKey, NULL);
+  int resortedSameTick = query->matches[query->count - 2] == secondEntity &&
+                         query->matches[query->count - 1] == firstEntity;
+
+  // and with no change since, the order is reused without waiting for a tick
+  sortKeyCalls = 0;
+  QuerySortByKey(bucket, query, materialType, MaterialKey, NULL);
+  int reusedSameTick = sortKeyCalls == 0;
+
+  sortCompareCalls = 0;
+  groupCount = QuerySortBy(bucket, query, CompareMaterialDescending,
+                           materialType, materialType);
+  int descending = ((Material *)materialType->entries[query->matches[0]])
+                       ->color == 0xffffffff;
+  BucketAdvanceTick(bucket);
+  int callsAfterFirstSort = sortCompareCalls;
+  QuerySortBy(bucket, query, CompareMaterialDescending, materialType,
+              materialType);
+  int comparatorCached = sortCompareCalls == callsAfterFirstSort;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(ordered);
+  ASSERT(slotsFollow);
+  ASSERT(reused);
+  ASSERT(resorted);
+  ASSERT(resortedSameTick);
+  ASSERT(reusedSameTick);
+  ASSERT(groupCount == 5 && descending);
+  ASSERT(comparatorCached);
+
+  printf("TestSortedQuery        PASSED\n");
+}
+
+typedef struct {
+  int tag;
+  struct {
+    float x;
+    float y;
+  } pos;
+} Agent;
+
+// Brute force check that a radius query found exactly the agents in range
+int RadiusMatchesBruteForce(Bucket *bucket, ComponentType *agentType,
+                            uint32_t *found, size_t foundCount, float x,
+                            float y, float radius) {
+  size_t expected = 0;
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    Agent *agent = agentType->entries[i];
+    if (!agent || !(bucket->entities[i]->mask & agentType->mask)) {
+      continue;
+    }
+    float dx = agent->pos.x - x;
+    float dy = agent->pos.y - y;
+    expected += dx * dx + dy * dy <= radius * radius;
+  }
+
+  int inRange = 1;
+  for (size_t i = 0; i < foundCount; i++) {
+    Agent *agent = agentType->entries[found[i]];
+    float dx = agent->pos.x - x;
+    float dy = agent->pos.y - y;
+    inRange &= dx * dx + dy * dy <= radius * radius;
+  }
+  return inRange && expected == foundCount;
+}
+
+void TestSpatialGrid() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  // spread agents over negative and positive coordinates
+  for (int i = 0; i < 400; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    Agent *agent = ADD_COMPONENT_TO_ENTITY(bucket, entity, Agent);
+    agent->tag = i;
+    agent->pos.x = (float)((i * 37) % 200) - 100.0f;
+    agent->pos.y = (float)((i * 91) % 200) - 100.0f;
+  }
+
+  SpatialGrid *grid = SPATIAL_GRID_CREATE(bucket, Agent, pos.x, pos.y, 16);
+  ComponentType *agentType = BucketGetComponentType(bucket, "Agent");
+
+  uint32_t found[400];
+  size_t count = SpatialGridQueryRadius(grid, -10, 5, 30, found, 400);
+  int radiusMatches =
+      RadiusMatchesBruteForce(bucket, agentType, found, count, -10, 5, 30);
+
+  count = SpatialGridQueryAABB(grid, -100, -100, 100, 100, found, 400);
+  int boxFindsAll = count == 400;
+
+  // move one agent across the world through a mutable get
+  BucketAdvanceTick(bucket);
+  Entity *mover = bucket->entities[7];
+  Agent *agent = GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, mover, Agent);
+  agent->pos.x = 500.0f;
+  agent->pos.y = -500.0f;
+  SpatialGridUpdate(grid);
+
+  count = SpatialGridQueryCell(grid, 501.0f, -499.0f, found, 400);
+  int moved = count == 1 && found[0] == mover->index;
+
+  count = SpatialGridQueryRadius(grid, -10, 5, 30, found, 400);
+  int stillMatches =
+      RadiusMatchesBruteForce(bucket, agentType, found, count, -10, 5, 30);
+
+  // agents that lose the component drop out, new ones show up after an update
+  REMOVE_COMPONENT_FROM_ENTITY(bucket, mover, Agent);
+  count = SpatialGridQueryCell(grid, 501.0f, -499.0f, found, 400);
+  int removed = count == 0;
+
+  Entity *newcomer = BucketCreateEntity(bucket);
+  agent = ADD_COMPONENT_TO_ENTITY(bucket, newcomer, Agent);
+  agent->pos.x = -300.0f;
+  agent->pos.y = -300.0f;
+  SpatialGridUpdate(grid);
+  count = SpatialGridQueryRadius(grid, -301.0f, -301.0f, 2, found, 400);
+  int added = count == 1 && found[0] == newcomer->index;
+
+  // far away and NaN positions land in saturated cells, and a box covering
+  // the whole float range walks the occupied cells rather than its area
+  BucketAdvanceTick(bucket);
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, bucket->entities[1], Agent)
+      ->pos.x = 1e30f;
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, bucket->entities[2], Agent)
+      ->pos.y = NAN;
+  SpatialGridUpdate(grid);
+  count = SpatialGridQueryCell(grid, 1e30f, -9.0f, found, 400);
+  int farAway = count == 1 && found[0] == 1;
+  count = SpatialGridQueryAABB(grid, -INFINITY, -INFINITY, INFINITY,
+                               INFINITY, found, 400);
+  int everythingButNaN = count == 399;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(grid != NULL);
+  ASSERT(radiusMatches);
+  ASSERT(boxFindsAll);
+  ASSERT(moved);
+  ASSERT(stillMatches);
+  ASSERT(removed);
+  ASSERT(added);
+  ASSERT(farAway);
+  ASSERT(everythingButNaN);
+
+  printf("TestSpatialGrid        PASSED\n");
+}
+
+void TestRelationships() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  // 0 -> {1, 2}, 1 -> {3} and a separate 4 -> {5}
+  Entity *entities[6];
+  for (int i = 0; i < 6; i++) {
+    entities[i] = BucketCreateEntity(bucket);
+  }
+  BucketSetParent(bucket, entities[3], entities[1]);
+  BucketSetParent(bucket, entities[2], entities[0]);
+  BucketSetParent(bucket, entities[5], entities[4]);
+  BucketSetParent(bucket, entities[1], entities[0]);
+
+  int rejectsCycle = !BucketSetParent(bucket, entities[0], entities[3]) &&
+                     !BucketSetParent(bucket, entities[4], entities[4]);
+  int parentSet = BucketGetParent(bucket, entities[3]) == entities[1] &&
+                  BucketGetParent(bucket, entities[0]) == NULL;
+
+  size_t childCount;
+  const uint32_t *children =
+      BucketGetChildren(bucket, entities[0], &childCount);
+  int childrenContiguous =
+      childCount == 2 && children[0] == 1 && children[1] == 2;
+
+  size_t orderCount;
+  const uint32_t *order =
+      BucketHierarchyOrder(bucket, HIERARCHY_BREADTH_FIRST, &orderCount);
+  uint32_t expectedBreadth[] = {0, 4, 1, 2, 5, 3};
+  uint32_t expectedBreadthDepths[] = {0, 0, 1, 1, 1, 2};
+  int breadthFirst = orderCount == 6;
+  for (size_t i = 0; i < orderCount; i++) {
+    breadthFirst &= order[i] == expectedBreadth[i] &&
+                    bucket->hierarchy->depths[i] == expectedBreadthDepths[i];
+  }
+
+  order = BucketHierarchyOrder(bucket, HIERARCHY_DEPTH_FIRST, &orderCount);
+  uint32_t expectedDepth[] = {0, 1, 3, 2, 4, 5};
+  uint32_t expectedDepthDepths[] = {0, 1, 2, 1, 0, 1};
+  int depthFirst = orderCount == 6;
+  for (size_t i = 0; i < orderCount; i++) {
+    depthFirst &= order[i] == expectedDepth[i] &&
+                  bucket->hierarchy->depths[i] == expectedDepthDepths[i];
+  }
+
+  // deleting 1 detaches it from 0 and leaves 3 without a parent
+  BucketDeleteEntity(bucket, 1);
+  children = BucketGetChildren(bucket, entities[0], &childCount);
+  int detached = childCount == 1 && children[0] == 2 &&
+                 BucketGetParent(bucket, entities[3]) == NULL;
+  BucketHierarchyOrder(bucket, HIERARCHY_BREADTH_FIRST, &orderCount);
+  int orderShrunk = orderCount == 4;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(rejectsCycle);
+  ASSERT(parentSet);
+  ASSERT(childrenContiguous);
+  ASSERT(breadthFirst);
+  ASSERT(depthFirst);
+  ASSERT(detached);
+  ASSERT(orderShrunk);
+
+  printf("TestRelationships        PASSED\n");
+}
+
+typedef struct {
+  int visits;
+} Work;
+
+int jobRuns = 0;
+
+void CountJob(void *data, int worker) {
+  __atomic_add_fetch(&jobRuns, 1, __ATOMIC_RELAXED);
+}
+
+// Long enough that a worker woken by the submit gets to steal some
+void SlowJob(void *data, int worker) {
+  usleep(1000);
+  *(int *)data = worker;
+}
+
+void VisitWork(Bucket *bucket, const uint32_t *entityIndexes, size_t count,
+               void *userData, int worker) {
+  ComponentType *workType = userData;
+  for (size_t i = 0; i < count; i++) {
+    Work *work = workType->entries[entityIndexes[i]];
+    __atomic_add_fetch(&work->visits, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void TestParallelFor() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  for (int i = 0; i < 5000; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    if (i % 3) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, Work);
+    }
+  }
+
+  Query *query = REGISTER_QUERY(bucket, Work);
+  ComponentType *workType = BucketGetComponentType(bucket, "Work");
+
+  // every grain size has to visit every match exactly once
+  JobSystem *jobs = JobSystemCreate(4, 0);
+  QueryParallelFor(jobs, bucket, query, 0, VisitWork, workType);
+  QueryParallelFor(jobs, bucket, query, 1, VisitWork, workType);
+  QueryParallelFor(jobs, bucket, query, 100000, VisitWork, workType);
+  QueryParallelFor(NULL, bucket, query, 7, VisitWork, workType);
+  JobSystemDestroy(jobs);
+
+  int visitedOnce = query->count == 3333;
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    Work *work = workType->entries[i];
+    if (i % 3) {
+      visitedOnce &= work->visits == 4;
+    }
+  }
+
+  ArenaDestroy(testArena);
+
+  ASSERT(visitedOnce);
+
+  printf("TestParallelFor        PASSED\n");
+}
+
+typedef struct {
+  float value;
+} Heat;
+typedef short Burning;
+
+char systemLog[16];
+int systemLogLength = 0;
+int coolerSawChanges = 0;
+
+// Only the first frames matter, later tests reuse the systems for longer
+void LogSystemRun(char c) {
+  if (systemLogLength < (int)sizeof(systemLog) - 1) {
+    systemLog[systemLogLength++] = c;
+  }
+}
+
+void HeatSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
+  LogSystemRun('h');
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, entity, Heat)->value += dt;
+}
+
+void CoolerSystem(Bucket *bucket, System *system, float dt) {
+  LogSystemRun('c');
+  ComponentType *heatType = system->userData;
+  for (size_t i = 0; i < system->query->count; i++) {
+    coolerSawChanges += ComponentChangedSince(
+        heatType, system->query->matches[i], system->lastRunTick);
+  }
+}
+
+void InputLogSystem(Bucket *bucket, System *system, float dt) {
+  LogSystemRun('i');
+}
+
+void TestSystemRegistry() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  for (int i = 0; i < 6; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, Heat);
+    if (i < 2) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entity, Burning);
+    }
+  }
+  ComponentType *heatType = BucketGetComponentType(bucket, "Heat");
+
+  // registered out of phase order on purpose
+  REGISTER_SYSTEM(bucket, .name = "Cooler", .phase = SYSTEM_PHASE_POST_UPDATE,
+                  .terms = {.include = COMPONENT_MASK(bucket, Heat)},
+                  .run = CoolerSystem, .userData = heatType);
+  REGISTER_SYSTEM(bucket, .name = "Heat", .phase = SYSTEM_PHASE_UPDATE,
+                  .terms = {.include = COMPONENT_MASK(bucket, Heat, Burning)},
+                  .each = HeatSystem);
+  REGISTER_SYSTEM(bucket, .name = "Input", .phase = SYSTEM_PHASE_PRE_UPDATE,
+                  .run = InputLogSystem);
+  System *invalid = REGISTER_SYSTEM(bucket, .name = "NoQuery",
+                                    .phase = SYSTEM_PHASE_UPDATE,
+                                    .each = HeatSystem);
+
+  BucketRunFrame(bucket, 0.5f);
+  int firstFrameOrdered = strncmp(systemLog, "ihhc", 4) == 0;
+  // the first run sees everything as changed
+  int firstSawAll = coolerSawChanges == 6;
+
+  // Heat writes 2 entities between the cooler's runs
+  coolerSawChanges = 0;
+  BucketRunFrame(bucket, 0.5f);
+  int secondSawWrites = coolerSawChanges == 2;
+
+  // a disabled system is skipped, and the cooler doesn't see its own reads
+  System *heat = BucketGetSystem(bucket, "Heat");
+  heat->disabled = 1;
+  coolerSawChanges = 0;
+  BucketRunFrame(bucket, 0.5f);
+  int disabledSkipped = coolerSawChanges == 0 && heat->runCount == 2;
+
+  Heat *burning = GET_COMPONENT_FROM_ENTITY(bucket, bucket->entities[0], Heat);
+  int heated = burning->value == 1.0f;
+  uint64_t frames = bucket->schedule->frame;
+
+  // the first system of a bucket failing to fit keeps the schedule it made
+  Arena *crampedArena = ArenaCreate(TEST_ARENA_SIZE);
+  Bucket *cramped = BucketCreate(crampedArena, 100);
+  crampedArena->capacity = crampedArena->top + sizeof(SystemSchedule) + 64;
+  System *tooBig = REGISTER_SYSTEM(cramped, .name = "Input",
+                                   .run = InputLogSystem);
+  int scheduleKept =
+      !tooBig && cramped->schedule &&
+      (char *)(cramped->schedule + 1) <= crampedArena->data + crampedArena->top;
+
+  ArenaDestroy(crampedArena);
+  ArenaDestroy(testArena);
+
+  ASSERT(invalid == NULL);
+  ASSERT(firstFrameOrdered);
+  ASSERT(firstSawAll);
+  ASSERT(secondSawWrites);
+  ASSERT(disabledSkipped);
+  ASSERT(heated);
+  ASSERT(frames == 3);
+  ASSERT(scheduleKept);
+
+  printf("TestSystemRegistry        PASSED\n");
+}
+
+typedef struct {
+  JobSystem *jobs;
+  Bucket *bucket;
+  Query *query;
+  ComponentType *workType;
+} NestedWork;
+
+void VisitWorkInParallel(void *data, int worker) {
+  NestedWork *nested = data;
+  QueryParallelFor(nested->jobs, nested->bucket, nested->query, 16, VisitWork,
+                   nested->workType);
+}
+
+void TestJobSystem() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  // pops come off the bottom, steals off the top
+  JobDeque *deque = aligned_alloc(64, sizeof(JobDeque));
+  memset(deque, 0, sizeof(JobDeque));
+  Job first = {0}, second = {0}, third = {0};
+  JobDequePush(deque, &first);
+  JobDequePush(deque, &second);
+  JobDequePush(deque, &third);
+  int dequeOrder = JobDequePop(deque) == &third &&
+                   JobDequeSteal(deque) == &first &&
+                   JobDequePop(deque) == &second && !JobDequePop(deque) &&
+                   !JobDequeSteal(deque);
+  free(deque);
+
+  JobSystem *jobs = JobSystemCreate(4, 1);
+
+  // more jobs than fit in a deque, the overflow runs inline
+  static Job counted[JOB_DEQUE_SIZE + 100];
+  for (int i = 0; i < JOB_DEQUE_SIZE + 100; i++) {
+    counted[i].fn = CountJob;
+  }
+  JobCounter counter = {0};
+  JobSystemSubmit(jobs, counted, JOB_DEQUE_SIZE + 100, &counter);
+  JobSystemWait(jobs, &counter);
+  int allRan = jobRuns == JOB_DEQUE_SIZE + 100 && counter.pending == 0;
+
+  // jobs can start parallel loops on the system they're running on
+  Bucket *bucket = BucketCreate(testArena, 100);
+  for (int i = 0; i < 1000; i++) {
+    ADD_COMPONENT_TO_ENTITY(bucket, BucketCreateEntity(bucket), Work);
+  }
+  NestedWork nested = {jobs, bucket, REGISTER_QUERY(bucket, Work),
+                       BucketGetComponentType(bucket, "Work")};
+  Job outer[3];
+  for (int i = 0; i < 3; i++) {
+    outer[i].fn = VisitWorkInParallel;
+    outer[i].data = &nested;
+  }
+  counter.pending = 0;
+  JobSystemSubmit(jobs, outer, 3, &counter);
+  JobSystemWait(jobs, &counter);
+
+  int nestedVisited = 1;
+  for (size_t i = 0; i < bucket->entityListEnd; i++) {
+    nestedVisited &= ((Work *)nested.workType->entries[i])->visits == 3;
+  }
+
+  // submitting to parked workers wakes them, every round gets spread out
+  // rather than left to the waiting thread
+  int roundsSpread = 0;
+  for (int round = 0; round < 20; round++) {
+    for (int wait = 0; wait < 1000 && __atomic_load_n(&jobs->sleepers,
+                                                      __ATOMIC_SEQ_CST) < 3;
+         wait++) {
+      usleep(1000);
+    }
+
+    Job slow[8];
+    int ranOn[8];
+    for (int i = 0; i < 8; i++) {
+      slow[i] = (Job){.fn = SlowJob, .data = &ranOn[i]};
+    }
+    counter.pending = 0;
+    JobSystemSubmit(jobs, slow, 8, &counter);
+    JobSystemWait(jobs, &counter);
+
+    int spread = 0;
+    for (int i = 1; i < 8; i++) {
+      spread |= ranOn[i] != ranOn[0];
+    }
+    roundsSpread += spread;
+  }
+
+  JobSystemDestroy(jobs);
+  ArenaDestroy(testArena);
+
+  ASSERT(dequeOrder);
+  ASSERT(allRan);
+  ASSERT(nestedVisited);
+  ASSERT(roundsSpread == 20);
+
+  printf("TestJobSystem        PASSED\n");
+}
+
+typedef struct {
+  int pressed;
+} Keys;
+typedef struct {
+  float x;
+} Sprite;
+
+pthread_t drawThread;
+int drawSawMoved = 0;
+
+void ReadKeysSystem(Bucket *bucket, Entity *entity, float dt,
+                    System *system) {
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, entity, Keys)->pressed++;
+}
+
+void DrawSpritesSystem(Bucket *bucket, Entity *entity, float dt,
+                       System *system) {
+  drawThread = pthread_self();
+  drawSawMoved += GET_COMPONENT_FROM_ENTITY(bucket, entity, Sprite)->x > 0;
+}
+
+void MoveSpritesSystem(Bucket *bucket, Entity *entity, float dt,
+                       System *system) {
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, entity, Sprite)->x += 1;
+}
+
+void TestSystemScheduling() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  Entity *player = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, player, Keys);
+  ADD_COMPONENT_TO_ENTITY(bucket, player, Sprite);
+
+  BitMask keysMask = COMPONENT_MASK(bucket, Keys);
+  BitMask spriteMask = COMPONENT_MASK(bucket, Sprite);
+
+  // keys and drawing share nothing so they overlap, moving writes what
+  // drawing reads so it has to wait for drawing to finish
+  REGISTER_SYSTEM(bucket, .name = "ReadKeys", .phase = SYSTEM_PHASE_PRE_UPDATE,
+                  .terms = {.include = keysMask}, .each = ReadKeysSystem,
+                  .writes = keysMask);
+  REGISTER_SYSTEM(bucket, .name = "Draw", .phase = SYSTEM_PHASE_UPDATE,
+                  .terms = {.include = spriteMask}, .each = DrawSpritesSystem,
+                  .reads = spriteMask, .mainThreadOnly = 1);
+  REGISTER_SYSTEM(bucket, .name = "Move", .phase = SYSTEM_PHASE_POST_UPDATE,
+                  .terms = {.include = spriteMask}, .each = MoveSpritesSystem,
+                  .writes = spriteMask);
+
+  JobSystem *jobs = JobSystemCreate(2, 0);
+  BucketSetJobSystem(bucket, jobs);
+  BucketRunFrame(bucket, 0.1f);
+
+  int twoWaves = bucket->schedule->waveCount == 2;
+  int drawnBeforeMove = drawSawMoved == 0;
+  int drawnOnMain = pthread_equal(drawThread, pthread_self());
+
+  // an exclusive system splits the frame in two
+  REGISTER_SYSTEM(bucket, .name = "Spawn", .phase = SYSTEM_PHASE_POST_UPDATE,
+                  .terms = {.include = keysMask}, .each = ReadKeysSystem,
+                  .exclusive = 1);
+  BucketRunFrame(bucket, 0.1f);
+  int exclusiveWave = bucket->schedule->waveCount == 3;
+  int drawnAfterMove = drawSawMoved == 1;
+
+  int keysPressed =
+      GET_COMPONENT_FROM_ENTITY(bucket, player, Keys)->pressed == 3;
+
+  JobSystemDestroy(jobs);
+  ArenaDestroy(testArena);
+
+  ASSERT(twoWaves);
+  ASSERT(drawnBeforeMove);
+  ASSERT(drawnOnMain);
+  ASSERT(exclusiveWave);
+  ASSERT(drawnAfterMove);
+  ASSERT(keysPressed);
+
+  printf("TestSystemScheduling        PASSED\n");
+}
+
+void TestProfiling() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+  for (int i = 0; i < 5; i++) {
+    Entity *entity = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, Heat);
+    ADD_COMPONENT_TO_ENTITY(bucket, entity, Burning);
+  }
+
+  System *heat = REGISTER_SYSTEM(
+      bucket, .name = "Heat \"quoted\"", .phase = SYSTEM_PHASE_UPDATE,
+      .terms = {.include = COMPONENT_MASK(bucket, Heat, Burning)},
+      .each = HeatSystem);
+
+  // nothing is recorded until profiling is switched on
+  BucketRunFrame(bucket, 0.1f);
+  int offUntilEnabled = heat->lastRunNs == 0;
+
+  ProfilerEnable(1);
+  ProfilerReset();
+  BucketRunFrame(bucket, 0.1f);
+  BucketRunFrame(bucket, 0.1f);
+  ProfilerEnable(0);
+  BucketRunFrame(bucket, 0.1f);
+
+  int counted = heat->lastEntityCount == 5 && bucket->schedule->lastFrameNs;
+
+  const char *path = "build/test_trace.json";
+  int written = ProfilerWriteChromeTrace(path);
+
+  char trace[8192] = {0};
+  FILE *file = fopen(path, "r");
+  size_t length = file ? fread(trace, 1, sizeof(trace) - 1, file) : 0;
+  if (file) {
+    fclose(file);
+  }
+  remove(path);
+
+  // two frames, each with an update phase and one system
+  int events = 0;
+  for (char *at = trace; (at = strstr(at, "\"ph\":\"X\"")); at++) {
+    events++;
+  }
+  int escaped = strstr(trace, "\"Heat \\\"quoted\\\"\"") != NULL;
+  int hasEntities = strstr(trace, "\"entities\":5") != NULL;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(offUntilEnabled);
+  ASSERT(counted);
+  ASSERT(written && length > 0);
+  ASSERT(strncmp(trace, "{\"displayTimeUnit\"", 18) == 0);
+  ASSERT(events == 6);
+  ASSERT(escaped);
+  ASSERT(hasEntities);
+
+  printf("TestProfiling        PASSED\n");
+}
+
+typedef struct {
+  int refreshes;
+} Path;
+
+int pathVisits = 0;
+
+void RefreshPathSystem(Bucket *bucket, Entity *entity, float dt,
+                       System *system) {
+  GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, entity, Path)->refreshes++;
+  pathVisits++;
+}
+
+void TestResumableSystem() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+  Entity *entities[100];
+  for (int i = 0; i < 100; i++) {
+    entities[i] = BucketCreateEntity(bucket);
+    ADD_COMPONENT_TO_ENTITY(bucket, entities[i], Path);
+  }
+
+  System *paths = REGISTER_SYSTEM(
+      bucket, .name = "Paths", .phase = SYSTEM_PHASE_UPDATE,
+      .terms = {.include = COMPONENT_MASK(bucket, Path)},
+      .each = RefreshPathSystem, .entityBudget = 30);
+
+  BucketRunFrame(bucket, 0.1f);
+  int budgetRespected = paths->lastEntityCount == 30 && paths->cursor == 30;
+
+  // churn both sides of the cursor, removing entities swaps query matches
+  // around but the pass still sees every survivor exactly once
+  BucketDeleteEntity(bucket, entities[5]->index);
+  BucketDeleteEntity(bucket, entities[60]->index);
+  REMOVE_COMPONENT_FROM_ENTITY(bucket, entities[99], Path);
+  Entity *late = BucketCreateEntity(bucket);
+  ADD_COMPONENT_TO_ENTITY(bucket, late, Path);
+
+  int frames = 1;
+  while (paths->passCount == 0) {
+    BucketRunFrame(bucket, 0.1f);
+    frames++;
+  }
+
+  int visitedOnce = 1;
+  for (int i = 0; i < 99; i++) {
+    if (i == 5 || i == 60) {
+      continue;
+    }
+    visitedOnce &=
+        GET_COMPONENT_FROM_ENTITY(bucket, entities[i], Path)->refreshes == 1;
+  }
+  int lateVisited =
+      GET_COMPONENT_FROM_ENTITY(bucket, late, Path)->refreshes == 1;
+  // 30 before the churn, then the 70 after the cursor less the deleted and
+  // stripped ones plus the late one
+  int passVisits = pathVisits;
+
+  // a time budget that is always spent still makes progress each frame, 16
+  // matches stepping over the deleted entity
+  paths->entityBudget = 0;
+  paths->timeBudgetNs = 1;
+  BucketRunFrame(bucket, 0.1f);
+  int timeSliced = paths->lastEntityCount == 16 && paths->cursor == 17 &&
+                   paths->passCount == 1;
+
+  // a sparse query still gets its whole budget every frame, 100 matches
+  // spread over 1000 entities take 30, 30, 30 and then the last 10
+  Arena *sparseArena = ArenaCreate(TEST_ARENA_SIZE);
+  Bucket *sparse = BucketCreate(sparseArena, 1000);
+  for (int i = 0; i < 1000; i++) {
+    Entity *entity = BucketCreateEntity(sparse);
+    if (i % 10 == 7) {
+      ADD_COMPONENT_TO_ENTITY(sparse, entity, Path);
+    }
+  }
+  System *sparsePaths = REGISTER_SYSTEM(
+      sparse, .name = "Paths", .phase = SYSTEM_PHASE_UPDATE,
+      .terms = {.include = COMPONENT_MASK(sparse, Path)},
+      .each = RefreshPathSystem, .entityBudget = 30);
+  size_t sparseCounts[4];
+  size_t sparsePasses[4];
+  for (int i = 0; i < 4; i++) {
+    BucketRunFrame(sparse, 0.1f);
+    sparseCounts[i] = sparsePaths->lastEntityCount;
+    sparsePasses[i] = sparsePaths->passCount;
+  }
+  int sparseBudgeted = sparseCounts[0] == 30 && sparseCounts[1] == 30 &&
+                       sparseCounts[2] == 30 && sparseCounts[3] == 10 &&
+                       sparsePasses[2] == 0 && sparsePasses[3] == 1;
+
+  ArenaDestroy(sparseArena);
+  ArenaDestroy(testArena);
+
+  ASSERT(budgetRespected);
+  ASSERT(frames == 4);
+  ASSERT(visitedOnce);
+  ASSERT(lateVisited);
+  ASSERT(passVisits == 99);
+  ASSERT(timeSliced);
+  ASSERT(sparseBudgeted);
+
+  printf("TestResumableSystem        PASSED\n");
+}
+
+void RecordDtSystem(Bucket *bucket, System *system, float dt) {
+  *(float *)system->userData = dt;
+}
+
+void TestFrameGovernor() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+
+  float physicsDt = 0, aiDt = 0, effectsDt = 0;
+  System *physics = REGISTER_SYSTEM(bucket, .name = "Physics",
+                                    .run = RecordDtSystem,
+                                    .userData = &physicsDt);
+  System *ai = REGISTER_SYSTEM(bucket, .name = "AI", .run = RecordDtSystem,
+                               .userData = &aiDt, .priority = 1,
+                               .minRunInterval = 2);
+  System *effects = REGISTER_SYSTEM(bucket, .name = "Effects",
+                                    .run = RecordDtSystem,
+                                    .userData = &effectsDt, .priority = 2);
+
+  BucketSetFrameBudget(bucket, 1000000);
+
+  // pretend the systems are slow so the frame is 200us over budget
+  physics->costNs = 600000;
+  ai->costNs = 300000;
+  effects->costNs = 300000;
+  BucketRunFrame(bucket, 0.1f);
+  int lowestDeferred = ai->runCount == 0 && effects->runCount == 1 &&
+                       physics->runCount == 1 &&
+                       bucket->schedule->deferredLastFrame == 1;
+
+  // ai has to run every other frame so effects gives way instead, and ai
+  // catches up on the frame it missed
+  physics->costNs = 600000;
+  ai->costNs = 300000;
+  effects->costNs = 300000;
+  BucketRunFrame(bucket, 0.1f);
+  int minRateKept = ai->runCount == 1 && effects->runCount == 1 &&
+                    ai->deferCount == 1 && effects->deferCount == 1;
+  int caughtUp = fabsf(aiDt - 0.2f) < 1e-5f && fabsf(physicsDt - 0.1f) < 1e-5f;
+
+  // within budget nothing is deferred
+  physics->costNs = 100000;
+  ai->costNs = 100000;
+  effects->costNs = 100000;
+  BucketRunFrame(bucket, 0.1f);
+  int allRan = bucket->schedule->deferredLastFrame == 0 &&
+               bucket->schedule->deferredTotal == 2 &&
+               fabsf(effectsDt - 0.2f) < 1e-5f && physics->runCount == 3;
+  int measured = bucket->schedule->lastFrameNs > 0 && physics->lastRunNs > 0;
+
+  // the same costs after a frame measured 800us over budget, the overrun comes
+  // out of this frame's allowance
+  physics->costNs = 100000;
+  ai->costNs = 100000;
+  effects->costNs = 100000;
+  bucket->schedule->lastFrameNs = 1800000;
+  BucketRunFrame(bucket, 0.1f);
+  int overrunRepaid = bucket->schedule->deferredLastFrame == 1 &&
+                      ai->deferCount == 2 && effects->deferCount == 1;
+
+  ArenaDestroy(testArena);
+
+  ASSERT(lowestDeferred);
+  ASSERT(minRateKept);
+  ASSERT(caughtUp);
+  ASSERT(allRan);
+  ASSERT(measured);
+  ASSERT(overrunRepaid);
+
+  printf("TestFrameGovernor        PASSED\n");
+}
+
+typedef struct {
+  int thinks;
+  float elapsed;
+} Brain;
+
+void ThinkSystem(Bucket *bucket, Entity *entity, float dt, System *system) {
+  Brain *brain = GET_MUTABLE_COMPONENT_FROM_ENTITY(bucket, entity, Brain);
+  brain->thinks++;
+  brain->elapsed += dt;
+}
+
+void TestStaggeredSystem() {
+  Arena *testArena = ArenaCreate(TEST_ARENA_SIZE);
+
+  Bucket *bucket = BucketCreate(testArena, 100);
+  Entity *entities[40];
+  for (int i = 0; i < 40; i++) {
+    entities[i] = BucketCreateEntity(bucket);
+    if (i % 5) {
+      ADD_COMPONENT_TO_ENTITY(bucket, entities[i], Brain);
+    }
+  }
+
+  BitMask brainMask = COMPONENT_MASK(bucket, Brain);
+  System *think = REGISTER_SYSTEM(
+      bucket, .name = "Think", .phase = SYSTEM_PHASE_UPDATE,
+      .terms = {.include = brainMask}, .each = ThinkSystem,
+      .updateInterval = 4);
+
+  // a quarter of the 32 brains each frame
+  BucketRunFrame(bucket, 0.1f);
+  int firstSlice = think->lastEntityCount == 8;
+
+  for (int frame = 1; frame < 8; frame++) {
+    BucketRunFrame(bucket, 0.1f);
+  }
+
+  // every brain thought twice, and what it was handed plus what its slice
+  // has built up since adds up to the whole 0.8s
+  int evenlySpread = 1;
+  for (int i = 0; i < 40; i++) {
+    if (i % 5) {
+      Brain *brain = GET_COMPONENT_FROM_ENTITY(bucket, entities[i], Brain);
+      float seen = brain->elapsed + think->sliceDt[i % 4];
+      evenlySpread &= brain->thinks == 2 && fabsf(seen - 0.8f) < 1e-5f;
+    }
+  }
+
+  // a sparse query walks its matches rather than every fourth entity
+  for (int i = 0; i < 40; i++) {
+    if (i % 5 && i != 9) {
+      REMOVE_COMPONENT_FROM_ENTITY(bucket, entities[i], Brain);
+    }
+  }
+  int sparseRuns = 0;
+  for (int frame = 0; frame < 4; frame++) {
+    BucketRunFrame(bucket, 0.1f);
+    sparseRuns += think->lastEntityCount;
+  }
+  Brain *lone = GET_COMPONENT_FROM_ENTITY(bucket, entities[9], Brain);
+  int sparseVisited = sparseRuns == 1 && lone->thinks == 3;
+
+  // staggering and budgets don't mix
+  System *rejected = REGISTER_SYSTEM(
+      bucket, .name = "Both", .terms = {.include = brainMask},
+      .each = ThinkSystem, .updateInterval = 2, .entityBudget = 10);
+  // run systems walk their matches themselves so neither applies to them
+  System *staggeredRun = REGISTER_SYSTEM(bucket, .name = "Run",
+                                         .run = RecordDtSystem,
+                                         .updateInterval = 2);
+  System *budgetedRun = REGISTER_SYSTEM(bucket, .name = "Run",
+                                        .run = RecordDtSystem,
+                                        .timeBudgetNs = 1000);
+
+  ArenaDestroy(testArena);
+
+  ASSERT(firstSlice);
+  ASSERT(evenlySpread);
+  ASSERT(sparseVisited);
+  ASSERT(rejected == NULL);
+  ASSERT(staggeredRun == NULL);
+  ASSERT(budgetedRun == NULL);
+
+  printf("TestStaggeredSystem        PASSED\n");
+}
+
 int main(void) {
   printf("Running tests for ecc.h\n");
   TestCreateBucket();
@@ -258,5 +2016,28 @@ int main(void) {
   TestAssignComponentTypeToEntityWithMacro();
   TestRemoveComponentTypeFromEntity();
   TestRemoveComponentTypeFromEntityWithMacro();
+  TestSharedComponents();
+  TestChangeTicks();
+  TestEnableDisableComponent();
+  TestCompaction();
+  TestComponentIdsAcrossBuckets();
+  TestComponentNameLookup();
+  TestGetMultipleComponents();
+  TestRegisteredQuery();
+  TestQuerySpans();
+  TestQueryTerms();
+  TestMaskScan();
+  TestBitsetQuery();
+  TestSortedQuery();
+  TestSpatialGrid();
+  TestRelationships();
+  TestParallelFor();
+  TestJobSystem();
+  TestSystemRegistry();
+  TestSystemScheduling();
+  TestProfiling();
+  TestResumableSystem();
+  TestFrameGovernor();
+  TestStaggeredSystem();
   return 0;
 }